@@ -45,6 +45,16 @@ struct Data
     float offset;
 };
 
+// Moves the content to the scrollbar's current value. The content is
+// translated instead of rebuilt, BuildLayout places it the same way
+void ApplyScrollbarValue(GUI::Layout* layout, Data* data)
+{
+    float oldOffset = data->offset;
+    functions->queryNumber(data->scrollbar, "value", &data->offset);
+    if(!layout->children.empty())
+        functions->translate(layout->children[0], 0.0f, oldOffset - data->offset);
+}
+
 extern "C"
 {
     bool IsLayout() { return true; }
@@ -163,8 +173,7 @@ extern "C"
     {
         Data* data = (Data*)layout->data;
         if(child == data->scrollbar) {
-            functions->queryNumber(data->scrollbar, "value", &data->offset);
-            functions->build(layout);
+            ApplyScrollbarValue(layout, data);
             return true;
         }
         return false;
@@ -179,8 +188,7 @@ extern "C"
     {
         Data* data = (Data*)layout->data;
         functions->setNumber(data->scrollbar, "value", data->offset - y);
-        functions->queryNumber(data->scrollbar, "value", &data->offset);
-        functions->build(layout);
+        ApplyScrollbarValue(layout, data);
 
         return true;
     }
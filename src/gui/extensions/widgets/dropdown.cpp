@@ -403,8 +403,6 @@ extern "C"
                     strcpy(data->text, buffer);
 
                     widget->offsetData = { 0, 0, 0 };
-                    functions->memdealloc(widget->vertices);
-                    functions->memdealloc(widget->indicies);
                     QUAD_ALLOC(widget, strlen(data->text) + 2);
 
                     BuildWidget(widget);
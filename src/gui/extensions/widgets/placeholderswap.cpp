@@ -22,7 +22,7 @@ static int fontHeight;
 struct Data
 {
     char* text;
-    char* placeholderTargetName;
+    int32_t placeholderTargetHandle; // -1 if there is no target
     Layout* placeholderTarget;
     char* layoutName;
 
@@ -72,7 +72,6 @@ extern "C"
     {
         Data* data = (Data*)widgetData;
         Text::Dealloc(functions, data->text);
-        functions->memdealloc(data->placeholderTargetName);
         functions->memdealloc(data->layoutName);
     }
 
@@ -87,12 +86,10 @@ extern "C"
         Text::Parse(state, functions, &data->text, &data->color, &data->origin, defaults);
 
         if(FieldExists(state, "placeholder_target")) {
-            const char* target = lua_tostring(state, -1);
-            data->placeholderTargetName = (char*)functions->memalloc(strlen(target) + 1);
-            strcpy(data->placeholderTargetName, target);
+            data->placeholderTargetHandle = functions->getNameHandle(lua_tostring(state, -1));
             lua_pop(state, 1);
         } else {
-            data->placeholderTargetName = nullptr;
+            data->placeholderTargetHandle = -1;
         }
 
         if(FieldExists(state, "layout")) {
@@ -115,12 +112,8 @@ extern "C"
     {
         Data* data = (Data*)widget->data;
 
-        if(data->placeholderTargetName != nullptr) {
-            // TODO: Error handling, use Element::type to check
-            data->placeholderTarget = (Layout*)functions->getNamedElement(data->placeholderTargetName);
-        } else {
-            data->placeholderTarget = nullptr;
-        }
+        // TODO: Error handling, use Element::type to check
+        data->placeholderTarget = (Layout*)functions->getHandleElement(data->placeholderTargetHandle);
 
         ClickableBackgroundColor::Build(widget, data->bgcolor);
         Text::Build(functions, widget, data->text, data->color, data->origin);
@@ -71,6 +71,23 @@ void UpdateText(Widget* widget) {
     widget->indexCount = 12 + strlen(buffer) * 6;
 }
 
+// Moves the thumb quad, vertices 4-7, to data->pos
+void MoveThumb(Widget* widget) {
+    Data* data = (Data*)widget->data;
+    Vertex* thumb = widget->vertices + 4;
+    if(data->direction == Scrollbar::HORIZONTAL) {
+        VertexWriter::SetPosition(thumb[0], data->pos, thumb[0].y);
+        VertexWriter::SetPosition(thumb[1], data->pos, thumb[1].y);
+        VertexWriter::SetPosition(thumb[2], data->pos + data->thumbSize, thumb[2].y);
+        VertexWriter::SetPosition(thumb[3], data->pos + data->thumbSize, thumb[3].y);
+    } else {
+        VertexWriter::SetPosition(thumb[0], thumb[0].x, data->pos);
+        VertexWriter::SetPosition(thumb[1], thumb[1].x, data->pos + data->thumbSize);
+        VertexWriter::SetPosition(thumb[2], thumb[2].x, data->pos + data->thumbSize);
+        VertexWriter::SetPosition(thumb[3], thumb[3].x, data->pos);
+    }
+}
+
 extern "C"
 {
     void Init(int fontHeight, const InitFunctions* functions)
@@ -233,7 +250,7 @@ extern "C"
         data->mouseInside = false;
 
         if(!data->mouseDown)
-            widget->update = false;
+            functions->setUpdate(widget, false);
     }
 
     void OnUpdate(GUI::Widget* widget, lua_State* state, int32_t x, int32_t y)
@@ -249,11 +266,6 @@ extern "C"
                                         , data->thumbSize
                                         , &data->currentValue
                                         , &data->pos);
-
-            widget->vertices[4].x = data->pos;
-            widget->vertices[5].x = data->pos;
-            widget->vertices[6].x = data->pos + data->thumbSize;
-            widget->vertices[7].x = data->pos + data->thumbSize;
         } else {
             Scrollbar::UpdateVertical(y
                                         , widget->bounds
@@ -263,12 +275,8 @@ extern "C"
                                         , data->thumbSize
                                         , &data->currentValue
                                         , &data->pos);
-
-            widget->vertices[4].y = data->pos;
-            widget->vertices[5].y = data->pos + data->thumbSize;
-            widget->vertices[6].y = data->pos + data->thumbSize;
-            widget->vertices[7].y = data->pos;
         }
+        MoveThumb(widget);
 
         if(data->textFormat)
             UpdateText(widget);
@@ -280,7 +288,7 @@ extern "C"
     {
         Data* data = (Data*)widget->data;
         data->mouseDown = true;
-        widget->update = true;
+        functions->setUpdate(widget, true);
         functions->stealMouse(widget);
 
         OnUpdate(widget, state, x, y);
@@ -291,11 +299,11 @@ extern "C"
     {
         Data* data = (Data*)widget->data;
         data->mouseDown = false;
-        widget->update = false;
+        functions->setUpdate(widget, false);
         functions->freeMouse(widget);
 
         if(!data->mouseInside)
-            widget->update = false;
+            functions->setUpdate(widget, false);
 
         return true;
     }
@@ -310,6 +318,7 @@ extern "C"
         if(streq(key, "value")) {
             Data* data = (Data*)widget->data;
             *value = data->currentValue;
+            return true;
         }
         return false;
     }
@@ -326,11 +335,6 @@ extern "C"
                                                     , data->maxValue
                                                     , data->thumbSize
                                                     , &data->pos);
-
-                widget->vertices[4].x = data->pos;
-                widget->vertices[5].x = data->pos;
-                widget->vertices[6].x = data->pos + data->thumbSize;
-                widget->vertices[7].x = data->pos + data->thumbSize;
             } else {
                 Scrollbar::UpdateVerticalValue(data->currentValue
                                                 , widget->bounds
@@ -338,12 +342,8 @@ extern "C"
                                                 , data->maxValue
                                                 , data->thumbSize
                                                 , &data->pos);
-
-                widget->vertices[4].y = data->pos;
-                widget->vertices[5].y = data->pos + data->thumbSize;
-                widget->vertices[6].y = data->pos + data->thumbSize;
-                widget->vertices[7].y = data->pos;
             }
+            MoveThumb(widget);
             widget->modified = true;
             return data->currentValue == value;
         }
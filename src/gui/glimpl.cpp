@@ -4,6 +4,7 @@
 #include <iostream>
 #include <vector>
 #include <cstring>
+#include <cstddef>
 #include <cassert>
 
 #if BUILD_SERVER
@@ -35,6 +36,27 @@ void main(){\
     vertexUV = uv;\
 }";
 
+// Used for GUI::DrawListFormat::QuadInstances. Each instance is drawn as a
+// triangle strip of 4 vertices, with the corner given by gl_VertexID
+const static char* instancedVertexShaderSource = "\
+#version 150\n\
+in vec4 rect;\
+in vec4 uvRect;\
+in vec4 color;\
+out vec4 vertexColor;\
+out vec2 vertexUV;\
+uniform vec2 resolution;\
+void main(){\
+    vec2 corner = vec2(gl_VertexID >> 1, gl_VertexID & 1);\
+    vertexColor = color;\
+    vec2 pos = (rect.xy + rect.zw * corner) / vec2(resolution);\
+    pos.y = 1.0f - pos.y;\
+    pos -= vec2(0.5f, 0.5f);\
+    pos *= 2.0f;\
+    gl_Position = vec4(pos, 0.0f, 1.0f);\
+    vertexUV = mix(uvRect.xy, uvRect.zw, corner);\
+}";
+
 const static char* fragmentShaderSource = "\
 #version 150\n\
 in vec4 vertexColor;\
@@ -48,24 +70,43 @@ void main(){\
 static GLuint shaderProgram;
 static GLuint vao[2]; //Double buffering
 static GLuint vbo[2];
-static GLuint ebo[2];
+static GLuint quadIndexBuffer; // Shared by both vaos, see GUI::GetQuadIndicies
+static int32_t quadIndexBufferCount = 0;
 static int vaoIndex = 0;
+// Set when vbo[vaoIndex] already holds this frame's draw lists
+static bool uploaded = false;
+static uint64_t vboGenerations[2] = { 0, 0 }; // Frame generation in each vbo
+static GUI::DrawListFormat format;
+static GLint instanceAttributes[3]; // rect, uvRect, color
 
 const static int MAX_QUADS = 1024;
 const static int MAX_VERTEX_COUNT = MAX_QUADS * 4;
-const static int MAX_INDEX_COUNT = MAX_QUADS * 6;
 
 static int resolutionX = 0;
 static int resolutionY = 0;
 
-void GLGUI::InitGUI(size_t resolutionX, size_t resolutionY) {
-    GUIImpl::InitGUI(resolutionX, resolutionY);
+// Points the instance attributes of the bound vao at firstInstance, since
+// there is no base instance draw call before GL 4.2
+static void SetInstanceAttributes(size_t firstInstance)
+{
+    const char* offset = (const char*)(firstInstance * sizeof(GUI::QuadInstance));
+    glVertexAttribPointer(instanceAttributes[0], 4, GL_FLOAT, GL_FALSE, sizeof(GUI::QuadInstance), (void*)offset);
+    glVertexAttribPointer(instanceAttributes[1], 4, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(GUI::QuadInstance), (void*)(offset + sizeof(float) * 4));
+    glVertexAttribPointer(instanceAttributes[2], 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(GUI::QuadInstance), (void*)(offset + sizeof(float) * 4 + sizeof(uint16_t) * 4));
+}
+
+void GLGUI::InitGUI(size_t resolutionX, size_t resolutionY, const GUI::Settings& guiSettings/*= GUI::Settings()*/) {
+    GUI::Settings settings = guiSettings;
+    settings.indexMode = GUI::IndexMode::SharedQuads;
+    GUIImpl::InitGUI(resolutionX, resolutionY, settings);
 
     ::resolutionX = resolutionX;
     ::resolutionY = resolutionY;
+    ::format = settings.format;
 
+    const char* vertexSource = format == GUI::DrawListFormat::QuadInstances ? instancedVertexShaderSource : vertexShaderSource;
     GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, nullptr);
+    glShaderSource(vertexShader, 1, &vertexSource, nullptr);
     glCompileShader(vertexShader);
     GLint status;
     glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &status);
@@ -98,25 +139,51 @@ void GLGUI::InitGUI(size_t resolutionX, size_t resolutionY) {
 
     glGenVertexArrays(2, vao);
     glGenBuffers(2, vbo);
-    glGenBuffers(2, ebo);
+    glGenBuffers(1, &quadIndexBuffer);
+    quadIndexBufferCount = 0;
+    vboGenerations[0] = vboGenerations[1] = 0;
+    uploaded = false;
     for(int i = 0; i < 2; ++i) {
         glBindVertexArray(vao[i]);
+
+        if(format == GUI::DrawListFormat::QuadInstances) {
+            glBindBuffer(GL_ARRAY_BUFFER, vbo[i]);
+            glBufferData(GL_ARRAY_BUFFER, MAX_QUADS * sizeof(GUI::QuadInstance), nullptr, GL_DYNAMIC_DRAW);
+
+            instanceAttributes[0] = glGetAttribLocation(shaderProgram, "rect");
+            instanceAttributes[1] = glGetAttribLocation(shaderProgram, "uvRect");
+            instanceAttributes[2] = glGetAttribLocation(shaderProgram, "color");
+            SetInstanceAttributes(0);
+            for(GLint attribute : instanceAttributes) {
+                glVertexAttribDivisor(attribute, 1);
+                glEnableVertexAttribArray(attribute);
+            }
+            continue;
+        }
+
         glBindBuffer(GL_ARRAY_BUFFER, vbo[i]);
         glBufferData(GL_ARRAY_BUFFER, MAX_VERTEX_COUNT * sizeof(GUI::Vertex), nullptr, GL_DYNAMIC_DRAW);
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo[i]);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, MAX_INDEX_COUNT * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quadIndexBuffer);
+
+#ifdef COMPACT_VERTICES
+        const GLenum positionType = GL_SHORT;
+        const GLenum uvType = GL_UNSIGNED_SHORT;
+#else
+        const GLenum positionType = GL_FLOAT;
+        const GLenum uvType = GL_FLOAT;
+#endif
 
         GLint position = glGetAttribLocation(shaderProgram, "position");
-        glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, sizeof(GUI::Vertex), 0);
+        glVertexAttribPointer(position, 2, positionType, GL_FALSE, sizeof(GUI::Vertex), (void*)offsetof(GUI::Vertex, x));
         glEnableVertexAttribArray(position);
 
         GLint uv = glGetAttribLocation(shaderProgram, "uv");
-        glVertexAttribPointer(uv, 2, GL_FLOAT, GL_TRUE, sizeof(GUI::Vertex), (void*)(sizeof(float) * 2));
+        glVertexAttribPointer(uv, 2, uvType, GL_TRUE, sizeof(GUI::Vertex), (void*)offsetof(GUI::Vertex, u));
         glEnableVertexAttribArray(uv);
 
         GLint color = glGetAttribLocation(shaderProgram, "color");
-        glVertexAttribPointer(color, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(GUI::Vertex), (void*)(sizeof(float) * 4));
+        glVertexAttribPointer(color, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(GUI::Vertex), (void*)offsetof(GUI::Vertex, r));
         glEnableVertexAttribArray(color);
     }
 
@@ -153,12 +220,34 @@ void GLGUI::ReloadGUI(lua_State* state)
     GUIImpl::ReloadGUI(state);
 }
 
+int GLGUI::GetReloadHandle()
+{
+    return GUIImpl::GetReloadHandle();
+}
+
+static void SetScissor(const GUI::Rect& clipRect)
+{
+    if(clipRect.x != 0 || clipRect.y != 0 || clipRect.width != 0 || clipRect.height != 0)
+        glScissor((GLint)clipRect.x, (GLint)(resolutionY - clipRect.y - clipRect.height), (GLsizei)clipRect.width, (GLsizei)clipRect.height);
+    else
+        glScissor(0, 0, resolutionX, resolutionY);
+}
+
 void GLGUI::DrawGUI()
 {
     //Timer drawTimer;
     //drawTimer.Start();
 
-    vaoIndex = (vaoIndex + 1) % 2;
+    // Nothing has to be uploaded if the frame didn't change since it was
+    // last uploaded
+    uint64_t frameGeneration = GUIImpl::GetFrameGeneration();
+    if(frameGeneration == vboGenerations[vaoIndex])
+        uploaded = true;
+
+    if(!uploaded) {
+        vaoIndex = (vaoIndex + 1) % 2;
+        vboGenerations[vaoIndex] = frameGeneration;
+    }
 
     glBindVertexArray(vao[vaoIndex]);
     glUseProgram(shaderProgram);
@@ -167,29 +256,6 @@ void GLGUI::DrawGUI()
     const GUI::DrawList* drawLists = GUIImpl::GetDrawLists();
 
     glBindBuffer(GL_ARRAY_BUFFER, vbo[vaoIndex]);
-    void* vertices = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-    size_t vertexOffset = 0;
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo[vaoIndex]);
-    void* indicies = glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);
-    size_t indexOffset = 0;
-
-    for(uint32_t i = 0; i < drawListCount; ++i) {
-        assert(vertexOffset + drawLists[i].vertexCount <= MAX_VERTEX_COUNT);
-        assert(indexOffset + drawLists[i].indexCount <= MAX_INDEX_COUNT);
-
-        std::memcpy((void*)((GUI::Vertex*)vertices + vertexOffset)
-                        , (void*)drawLists[i].vertices
-                        , sizeof(GUI::Vertex) * drawLists[i].vertexCount);
-        vertexOffset += drawLists[i].vertexCount;
-
-        std::memcpy((void*)((GLuint*)indicies + indexOffset)
-                        , (void*)drawLists[i].indicies
-                        , sizeof(GLuint) * drawLists[i].indexCount);
-        indexOffset += drawLists[i].indexCount;
-    }
-    glUnmapBuffer(GL_ARRAY_BUFFER);
-    glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
 
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -197,18 +263,60 @@ void GLGUI::DrawGUI()
 
     glBindTexture(GL_TEXTURE_2D, fontTexture);
     glEnable(GL_SCISSOR_TEST);
-    glScissor(0, 0, resolutionX, resolutionY);
 
-    indexOffset = 0;
+    if(format == GUI::DrawListFormat::QuadInstances) {
+        if(!uploaded) {
+            void* instances = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+            size_t instanceOffset = 0;
+
+            for(uint32_t i = 0; i < drawListCount; ++i) {
+                assert(instanceOffset + drawLists[i].instanceCount <= MAX_QUADS);
+
+                std::memcpy((void*)((GUI::QuadInstance*)instances + instanceOffset)
+                                , (void*)drawLists[i].instances
+                                , sizeof(GUI::QuadInstance) * drawLists[i].instanceCount);
+                instanceOffset += drawLists[i].instanceCount;
+            }
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        }
+        uploaded = false;
+
+        for(uint32_t i = 0; i < drawListCount; ++i) {
+            SetScissor(drawLists[i].clipRect);
+            SetInstanceAttributes(drawLists[i].baseInstance);
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, drawLists[i].instanceCount);
+        }
+        glScissor(0, 0, resolutionX, resolutionY);
+        return;
+    }
+
+    if(!uploaded) {
+        void* vertices = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+        size_t vertexOffset = 0;
+
+        for(uint32_t i = 0; i < drawListCount; ++i) {
+            assert(vertexOffset + drawLists[i].vertexCount <= MAX_VERTEX_COUNT);
+
+            std::memcpy((void*)((GUI::Vertex*)vertices + vertexOffset)
+                            , (void*)drawLists[i].vertices
+                            , sizeof(GUI::Vertex) * drawLists[i].vertexCount);
+            vertexOffset += drawLists[i].vertexCount;
+        }
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+    uploaded = false;
+
+    // The quad indicies only grow, and only need to be uploaded when they do
+    int32_t quadIndexCount = GUIImpl::GetQuadIndexCount();
+    if(quadIndexCount > quadIndexBufferCount) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quadIndexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, quadIndexCount * sizeof(GLuint), GUIImpl::GetQuadIndicies(), GL_STATIC_DRAW);
+        quadIndexBufferCount = quadIndexCount;
+    }
+
     for(uint32_t i = 0; i < drawListCount; ++i) {
-        GUI::Rect clipRect = drawLists[i].clipRect;
-        if(clipRect.x != 0 || clipRect.y != 0 || clipRect.width != 0 || clipRect.height != 0)
-            glScissor((GLint)clipRect.x, (GLint)(resolutionY - clipRect.y - clipRect.height), (GLsizei)clipRect.width, (GLsizei)clipRect.height);
-        else
-            glScissor(0, 0, resolutionX, resolutionY);
-
-        glDrawElements(GL_TRIANGLES, drawLists[i].indexCount, GL_UNSIGNED_INT, (void*)(indexOffset * sizeof(GLuint)));
-        indexOffset += drawLists[i].indexCount;
+        SetScissor(drawLists[i].clipRect);
+        glDrawElementsBaseVertex(GL_TRIANGLES, drawLists[i].indexCount, GL_UNSIGNED_INT, nullptr, drawLists[i].baseVertex);
     }
     glScissor(0, 0, resolutionX, resolutionY);
 
@@ -248,6 +356,7 @@ void GLGUI::DestroyGUI(lua_State* state)
     glDeleteProgram(shaderProgram);
     glDeleteVertexArrays(2, vao);
     glDeleteBuffers(2, vbo);
+    glDeleteBuffers(1, &quadIndexBuffer);
     glDeleteTextures(1, &fontTexture);
 
     GUIImpl::DestroyGUI(state);
@@ -265,9 +374,64 @@ void GLGUI::ResolutionChanged(lua_State* state, int32_t width, int32_t height)
     glUniform2f(resolutionUniform, (float)width, (float)height);
 }
 
-void GLGUI::UpdateGUI(lua_State* state, uint32_t x, uint32_t y)
+#if !BUILD_SERVER
+static bool mapped = false;
+
+static bool MapNextBuffer(GUI::OutputSink* sink)
 {
-    GUIImpl::UpdateGUI(state, x, y);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[(vaoIndex + 1) % 2]);
+    void* buffer = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+    if(!buffer) {
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        return false;
+    }
+    mapped = true;
+
+    if(format == GUI::DrawListFormat::QuadInstances) {
+        sink->instances = (GUI::QuadInstance*)buffer;
+        sink->instanceCapacity = MAX_QUADS;
+    } else {
+        sink->vertices = (GUI::Vertex*)buffer;
+        sink->vertexCapacity = MAX_VERTEX_COUNT;
+    }
+    return true;
+}
+#endif
+
+GUI::UpdateStatus GLGUI::UpdateGUI(lua_State* state, uint32_t x, uint32_t y)
+{
+#if BUILD_SERVER
+    return GUIImpl::UpdateGUI(state, x, y);
+#else
+    // The GUI writes the draw lists straight into the buffer drawn next,
+    // instead of DrawGUI copying them there. It is only mapped if the GUI
+    // has a new frame to write
+    GUI::OutputSink sink = {};
+    sink.generation = vboGenerations[vaoIndex];
+    sink.map = MapNextBuffer;
+    mapped = false;
+
+    GUI::UpdateStatus status = GUIImpl::UpdateGUI(state, x, y, &sink);
+    if(mapped) {
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // If nothing changed the current buffer is drawn again. On overflow
+    // DrawGUI copies from the GUI's own buffers as before, and its asserts
+    // catch the draw lists not fitting
+    if(sink.unchanged) {
+        uploaded = true;
+    } else if(!sink.overflowed) {
+        vaoIndex = (vaoIndex + 1) % 2;
+        vboGenerations[vaoIndex] = sink.generation;
+        uploaded = true;
+    } else {
+        uploaded = false;
+    }
+
+    return status;
+#endif
 }
 
 void GLGUI::MouseDown(lua_State* state, int32_t x, int32_t y)
@@ -285,6 +449,11 @@ void GLGUI::Scroll(lua_State* state, int32_t mouseX, int32_t mouseY, int32_t scr
     GUIImpl::Scroll(state, mouseX, mouseY, scrollX, scrollY);
 }
 
+bool GLGUI::PushInput(const GUI::InputEvent& event)
+{
+    return GUIImpl::PushInput(event);
+}
+
 void GLGUI::RegisterSharedLibrary(const char* name, const char* path)
 {
     GUIImpl::RegisterSharedLibrary(name, path);
@@ -8,18 +8,23 @@
 
 namespace GLGUI
 {
-    void InitGUI(size_t resolutionX, size_t resolutionY);
+    // Always uses IndexMode::SharedQuads. DrawListFormat::QuadInstances
+    // requires GL 3.3 or ARB_instanced_arrays
+    void InitGUI(size_t resolutionX, size_t resolutionY, const GUI::Settings& settings = GUI::Settings());
     void BuildGUI(lua_State* state, const char* path);
     void ReloadGUI(lua_State* state);
+    int GetReloadHandle();
     void DrawGUI();
     void DestroyGUI(lua_State* state);
     void ResolutionChanged(lua_State* state, int32_t width, int32_t height);
 
-    void UpdateGUI(lua_State* state, uint32_t x, uint32_t y);
+    // DrawGUI only has to be called if the returned status says so
+    GUI::UpdateStatus UpdateGUI(lua_State* state, uint32_t x, uint32_t y);
 
     void MouseDown(lua_State* state, int32_t x, int32_t y);
     void MouseUp(lua_State* state, int32_t x, int32_t y);
     void Scroll(lua_State* state, int32_t mouseX, int32_t mouseY, int32_t scrollX, int32_t scrollY);
+    bool PushInput(const GUI::InputEvent& event);
 
     void RegisterSharedLibrary(const char* name, const char* path);
 }
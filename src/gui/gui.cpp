@@ -4,6 +4,7 @@
 
 #include <poll.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include <map>
@@ -12,9 +13,11 @@
 #include <cstring>
 #include <vector>
 #include <stack>
-#include <map>
 #include <algorithm>
 #include <iostream>
+#include <cassert>
+#include <atomic>
+#include <new>
 #include <dlfcn.h>
 #include <freetype2/ft2build.h>
 #include FT_FREETYPE_H
@@ -23,6 +26,10 @@
 #include <valgrind/valgrind.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <timer.h>
 
 // TODO: Keep everything the same after reloading
@@ -99,12 +106,176 @@ namespace GUI
     };
     static std::vector<Extension> extensions;
 
+    // Interns names into dense IDs, so looking a name up hashes it once
+    // instead of comparing it against every known name. IDs are never
+    // reused until Clear is called
+    class NameTable
+    {
+    public:
+        NameTable()
+            : slots(16, -1)
+        { }
+
+        // Returns the ID of name, or -1 if it hasn't been interned
+        int32_t Find(const char* name) const
+        {
+            return Find(name, Hash(name));
+        }
+
+        // Returns the ID of name, adding it if needed
+        int32_t Intern(const char* name)
+        {
+            uint32_t hash = Hash(name);
+            int32_t id = Find(name, hash);
+            if(id != -1)
+                return id;
+
+            id = (int32_t)names.size();
+            names.push_back(name);
+            hashes.push_back(hash);
+
+            // Keep the load factor below 1/2
+            if(names.size() * 2 > slots.size()) {
+                slots.assign(slots.size() * 2, -1);
+                for(int32_t i = 0; i < id; ++i)
+                    Insert(i);
+            }
+            Insert(id);
+
+            return id;
+        }
+
+        const char* Name(int32_t id) const
+        {
+            return names[id].c_str();
+        }
+
+        size_t Size() const
+        {
+            return names.size();
+        }
+
+        void Clear()
+        {
+            names.resize(0);
+            hashes.resize(0);
+            slots.assign(16, -1);
+        }
+
+    private:
+        std::vector<std::string> names; // Indexed by ID
+        std::vector<uint32_t> hashes; // Indexed by ID
+        std::vector<int32_t> slots; // Open addressing, -1 if empty. Size is a power of two
+
+        // FNV-1a
+        static uint32_t Hash(const char* name)
+        {
+            uint32_t hash = 2166136261u;
+            for(; *name != '\0'; ++name)
+                hash = (hash ^ (uint8_t)*name) * 16777619u;
+            return hash;
+        }
+
+        int32_t Find(const char* name, uint32_t hash) const
+        {
+            size_t mask = slots.size() - 1;
+            for(size_t i = hash & mask; slots[i] != -1; i = (i + 1) & mask) {
+                if(hashes[slots[i]] == hash && names[slots[i]] == name)
+                    return slots[i];
+            }
+            return -1;
+        }
+
+        void Insert(int32_t id)
+        {
+            size_t mask = slots.size() - 1;
+            size_t i = hashes[id] & mask;
+            while(slots[i] != -1)
+                i = (i + 1) & mask;
+            slots[i] = id;
+        }
+    };
+
+    // Extension names, extensionIndices maps the ID of a name to the first
+    // extension registered with it
+    static NameTable extensionNames;
+    static std::vector<int32_t> extensionIndices;
+
+    // Called whenever extensions changes, since indices shift on removal
+    void UpdateExtensionNames()
+    {
+        extensionNames.Clear();
+        extensionIndices.resize(0);
+        for(size_t i = 0; i < extensions.size(); ++i) {
+            if(extensionNames.Intern(extensions[i].name) == (int32_t)extensionIndices.size())
+                extensionIndices.push_back((int32_t)i);
+        }
+    }
+
+    // Returns the index of the extension called name, or -1
+    int FindExtension(const char* name)
+    {
+        int32_t id = extensionNames.Find(name);
+        return id == -1 ? -1 : extensionIndices[id];
+    }
+
+    // Bits of EventHandlers::capabilities
+    enum CAPABILITY {
+        ON_ENTER = 1 << 0
+        , ON_EXIT = 1 << 1
+        , ON_CLICK = 1 << 2
+        , ON_RELEASE_INSIDE = 1 << 3
+        , ON_RELEASE_OUTSIDE = 1 << 4
+        , ON_SCROLL = 1 << 5
+        , ON_UPDATE = 1 << 6
+        , ON_CHILD_CLICKED = 1 << 7
+        , ON_CHILD_RELEASED = 1 << 8
+        , ON_CHILD_UPDATE = 1 << 9
+    };
+
+    // The event functions of extensions[i], kept apart from the rest of the
+    // extension so dispatching events touches as little memory as possible
+    struct EventHandlers
+    {
+        uint32_t capabilities;
+        OnEnterFunction onEnter;
+        OnExitFunction onExit;
+        OnClickFunction onClick;
+        OnReleaseInsideFunction onReleaseInside;
+        OnReleaseOutsideFunction onReleaseOutside;
+        OnScrollFunction onScroll;
+        OnUpdateFunction onUpdate;
+        OnChildClickedFunction onChildClicked;
+        OnChildReleasedFunction onChildReleased;
+        OnChildUpdateFunction onChildUpdate;
+    };
+    static std::vector<EventHandlers> eventHandlers;
+
+    bool HasCapability(const Element* element, uint32_t capability)
+    {
+        return element->extension != -1 && (eventHandlers[element->extension].capabilities & capability) != 0;
+    }
+
     struct TypeInferInfo 
     {
         char type[TYPE_MAX_LENGTH];
         std::vector<std::string> members;
     };
-    static std::vector<TypeInferInfo> typeInferInfo;
+
+    // The inferred table compiled so InferType can find the first matching
+    // rule with a single pass over the keys of an element. Each key maps to
+    // a bitmap of the rules requiring it, and a rule matches once all of its
+    // distinct members have been seen
+    struct TypeInferRules
+    {
+        std::vector<std::string> types; // Indexed by rule
+        std::vector<int32_t> memberCounts; // Indexed by rule
+        NameTable keys;
+        std::vector<uint64_t> keyRules; // words bits per key, bit r is set if rule r requires the key
+        size_t words;
+        std::vector<int32_t> matches; // Scratch space for InferType, indexed by rule
+    };
+    static TypeInferRules typeInferRules = { {}, {}, NameTable(), {}, 0, {} };
 
     struct Popup
     {
@@ -115,6 +286,9 @@ namespace GUI
         // Every popup gets its own widget mask.
         // All widgets in a popup has the same widget mask as the popup itself
         int32_t widgetMask;
+        // Range of widgets holding every widget in the popup
+        int32_t firstWidget;
+        int32_t lastWidget;
     };
     static std::vector<Popup> popups;
 
@@ -126,20 +300,277 @@ namespace GUI
     static size_t resolutionX;
     static size_t resolutionY;
 
+    // Widgets are stored contiguously in tree order, and extensions parse
+    // children at pointers they compute from their own, so widgets can't be
+    // split into chunks or move while parsing. Address space for MAX_WIDGETS
+    // is reserved once instead, and only backed by memory as widgets are
+    // added. If it can't be reserved, or a GUI doesn't fit, BuildGUI counts
+    // the widgets first and they are stored in memory of exactly that size.
+    // Has the parts of std::vector's interface the GUI uses
+    struct WidgetStore
+    {
+        const static size_t MAX_WIDGETS = 1 << 20;
+
+        Widget* widgets;
+        size_t count;
+        size_t capacity;
+        bool counted; // Widgets are in memory from Allocate instead of reserved
+        bool overflowed; // Set when resize was asked for more than capacity
+
+        Widget* data()
+        {
+            if(!widgets && !counted) {
+                void* memory = mmap(nullptr, MAX_WIDGETS * sizeof(Widget), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if(memory != MAP_FAILED) {
+                    widgets = (Widget*)memory;
+                    capacity = MAX_WIDGETS;
+                } else {
+                    std::cerr << "Couldn't reserve memory for widgets, counting them before parsing instead" << std::endl;
+                    counted = true;
+                }
+            }
+            return widgets;
+        }
+
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        Widget& operator[](size_t index) { return widgets[index]; }
+
+        // Replaces the memory of an empty store with room for exactly
+        // newCapacity widgets
+        void Allocate(size_t newCapacity)
+        {
+            assert(count == 0);
+            if(widgets && !counted)
+                munmap(widgets, MAX_WIDGETS * sizeof(Widget));
+            else
+                free(widgets);
+
+            counted = true;
+            capacity = newCapacity;
+            // Never nullptr, parsing starts from data() even without widgets
+            widgets = (Widget*)malloc(std::max(newCapacity, (size_t)1) * sizeof(Widget));
+            if(!widgets) {
+                std::cerr << "Couldn't allocate memory for " << newCapacity << " widgets" << std::endl;
+                capacity = 0;
+            }
+        }
+
+        // Returns false, leaving the widgets as they are, if newCount doesn't
+        // fit. Shrinking to 0 clears overflowed
+        bool resize(size_t newCount)
+        {
+            Widget* memory = data();
+            if(newCount > capacity) {
+                overflowed = true;
+                return false;
+            }
+
+            for(size_t i = count; i < newCount; ++i)
+                new (memory + i) Widget();
+            for(size_t i = newCount; i < count; ++i)
+                memory[i].~Widget();
+            count = newCount;
+
+            // Give the memory of a destroyed GUI back
+            if(count == 0) {
+                if(memory && !counted)
+                    madvise(memory, MAX_WIDGETS * sizeof(Widget), MADV_DONTNEED);
+                overflowed = false;
+            }
+            return true;
+        }
+    };
+
     // All widgets in the entire GUI
-    static std::vector<Widget> widgets;
+    static WidgetStore widgets = { nullptr, 0, 0, false, false };
     static Layout* rootLayout;
     static std::vector<Layout*> preparsedLayouts;
 
     static std::vector<DrawList> drawLists;
-    // All vertices and indicies, updates as needed
-    static std::vector<Vertex> vertices;
-    static std::vector<uint32_t> indicies;
+
+    static Settings settings;
+
+    // Where a widget was copied to the last time its draw list was assembled
+    struct AssembledWidget
+    {
+        int32_t widget;
+        int32_t vertexCount;
+        int32_t indexCount;
+        int32_t vertexOffset; // Offsets into the draw list's vertices and indicies
+        int32_t indexOffset;
+        uint64_t clipRect; // Clip rect applied on the CPU when copying, 0 if none
+
+        bool operator==(const AssembledWidget& rhs) const
+        {
+            return widget == rhs.widget
+                    && vertexCount == rhs.vertexCount
+                    && indexCount == rhs.indexCount
+                    && vertexOffset == rhs.vertexOffset
+                    && indexOffset == rhs.indexOffset
+                    && clipRect == rhs.clipRect;
+        }
+    };
+
+    // The vertices and indicies of a draw list are kept between frames. If
+    // a draw list ends up with exactly the same widgets as last frame, only
+    // modified widgets are copied again
+    struct AssembledDrawList
+    {
+        std::vector<AssembledWidget> widgets;
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indicies;
+        // Value added to all indicies. Only nonzero for IndexMode::Rebased
+        uint32_t indexBase;
+        std::vector<QuadInstance> instances; // Used instead of vertices for DrawListFormat::QuadInstances
+
+        uint64_t clipRect; // Clip rect of the draw list itself
+        uint64_t generation;
+        // Set when the widgets were written to an OutputSink instead, in
+        // which case vertices, indicies and instances are out of date
+        bool stale;
+    };
+    static std::vector<AssembledDrawList> assembledDrawLists;
+    // The widgets of each batch group this frame, see UpdateGenerations
+    static std::vector<std::vector<AssembledWidget>> groupWidgets;
+
+    static uint64_t generationCounter = 0; // Last generation given to a draw list
+    static uint64_t frameGeneration = 0;
+
+    // All drawn widgets sharing a layer and clip rect. Batches are reused
+    // between frames to avoid reallocating their widget lists
+    struct Batch
+    {
+        int32_t layer;
+        uint64_t clipRect;
+        std::vector<int32_t> widgets;
+
+        Rect bounds; // Union of the bounds of all widget vertices, clipped by clipRect
+        bool quadsOnly; // Whether all widgets are made of quads, which can be clipped on the CPU
+    };
+
+    // Batches drawn together in a single draw list. If the batches have
+    // different clip rects their quads are clipped on the CPU and the draw
+    // list has no clip rect
+    struct BatchGroup
+    {
+        std::vector<int32_t> batches;
+        uint64_t clipRect;
+        bool mixedClipRects;
+        bool mergeable;
+        Rect bounds;
+    };
+
+    struct BatchKey
+    {
+        int32_t layer;
+        uint64_t clipRect;
+
+        bool operator==(const BatchKey& rhs) const
+        {
+            return layer == rhs.layer && clipRect == rhs.clipRect;
+        }
+    };
+
+    struct BatchKeyHash
+    {
+        size_t operator()(const BatchKey& key) const
+        {
+            return std::hash<uint64_t>()(key.clipRect ^ ((uint64_t)(uint32_t)key.layer * 0x9E3779B97F4A7C15ull));
+        }
+    };
+
+    static std::vector<Batch> batches;
+    static std::vector<int32_t> batchOrder; // Indicies into batches, in draw order
+    static std::unordered_map<BatchKey, int32_t, BatchKeyHash> batchLookup;
+    static std::vector<BatchGroup> batchGroups;
+    static int32_t batchGroupCount = 0;
+    static bool mergeBatches = true;
+
+    // An idle frame skips batching and assembling draw lists entirely.
+    // frameDirty is set whenever widgets may have been changed, which is only
+    // when extensions are called or the core changes them. batchesDirty is
+    // set when the draw flag, layer, clip rect or vertex count of a widget may
+    // have changed, which means the batches have to be rebuilt
+    static bool frameDirty = true;
+    static bool batchesDirty = true;
+
+    void MarkFrameDirty()
+    {
+        frameDirty = true;
+    }
+
+    void MarkBatchesDirty()
+    {
+        frameDirty = true;
+        batchesDirty = true;
+    }
+
+    // What a widget last drew, so BuildBatches only has to look at the
+    // vertices of modified widgets. Indexed by widget
+    struct WidgetExtent
+    {
+        Rect vertexBounds;
+        int32_t vertexCount;
+        int32_t indexCount;
+    };
+    static std::vector<WidgetExtent> widgetExtents;
+
+    // Totals of every drawn widget, counted by BuildBatches
+    static int32_t drawnVertexCount = 0;
+    static int32_t drawnIndexCount = 0;
+
+    static Statistics statistics;
+
+    // Uniform grid over the screen used for hit testing. Each cell lists the
+    // widgets whose bounds, clipped by their clip rect, overlap it, in widget
+    // order. Draw, layer and mask change often and are checked when querying,
+    // so the grid only has to be rebuilt when bounds or clip rects change
+    const static int32_t HIT_GRID_CELL_SIZE = 64;
+    struct HitGrid
+    {
+        int32_t columns;
+        int32_t rows;
+        std::vector<int32_t> cellStart; // Cell i's widgets are entries[cellStart[i]] to entries[cellStart[i + 1]]
+        std::vector<int32_t> entries;
+    };
+    static HitGrid hitGrid;
+
+    // Structure of arrays copy of the fields hit testing reads, so tests don't
+    // have to pull whole widgets into the cache. min and max are the widget
+    // bounds clipped by the clip rect, draw is 0 or -1 so it can be used as a
+    // SIMD mask. Padded to a multiple of 4 with widgets that never hit
+    struct HitFields
+    {
+        std::vector<float> minX;
+        std::vector<float> minY;
+        std::vector<float> maxX;
+        std::vector<float> maxY;
+        std::vector<int32_t> draw;
+        std::vector<int32_t> layer;
+        std::vector<int32_t> mask;
+    };
+    static HitFields hitFields;
+
+    // Set when bounds or clip rects change, the grid and hitFields are then
+    // rebuilt on the next hit test. Draw, layer and mask are written through
+    static bool hitGridDirty = true;
+    // Changes whenever anything hit testing depends on changes
+    static uint64_t hitGeneration = 1;
+
+    void InvalidateHitGrid()
+    {
+        hitGridDirty = true;
+        ++hitGeneration;
+    }
 
     static std::stack<int32_t> defaultsStack;
 
-    static std::map<std::string, int32_t> namedWidgets;
-    static std::map<std::string, Layout*> namedLayouts;
+    // Element names are kept between builds so handles given to extensions
+    // through InitFunctions::getNameHandle stay valid. namedElements is
+    // indexed by the ID of a name, nullptr if no element has it
+    static NameTable elementNames;
+    static std::vector<Element*> namedElements;
 
     // These are indicies into the widgets list.
     // A popup has its own hoveredWidget and downWidget; these are only used
@@ -158,37 +589,37 @@ namespace GUI
     // Returns the extension ID based on the type infer info in the lua file
     int InferType(lua_State* state)
     {
-        const char* type = nullptr;
-        for(const TypeInferInfo& info : typeInferInfo) {
-            type = info.type;
-            for(const std::string& members : info.members) {
-                lua_getfield(state, -1, members.c_str());
-                if(lua_isnil(state, -1)) {
-                    type = nullptr;
-                    lua_pop(state, 1);
-                    break;
+        TypeInferRules& rules = typeInferRules;
+        if(rules.types.empty())
+            return -1;
+
+        std::fill(rules.matches.begin(), rules.matches.end(), 0);
+
+        lua_pushnil(state);
+        while(lua_next(state, -2)) {
+            // lua_tostring would convert number keys in place and break lua_next
+            if(lua_type(state, -2) == LUA_TSTRING) {
+                int32_t key = rules.keys.Find(lua_tostring(state, -2));
+                if(key != -1) {
+                    const uint64_t* keyRules = &rules.keyRules[key * rules.words];
+                    for(size_t word = 0; word < rules.words; ++word) {
+                        int32_t rule = (int32_t)(word * 64);
+                        for(uint64_t bits = keyRules[word]; bits != 0; bits >>= 1, ++rule) {
+                            if(bits & 1)
+                                ++rules.matches[rule];
+                        }
+                    }
                 }
-                lua_pop(state, 1);
             }
-            if(type != nullptr)
-                break;
+            lua_pop(state, 1);
         }
 
-        if(type == nullptr)
-            return -1;
-
-        int index = -1;
-        for(size_t i = 0; i < extensions.size(); ++i) {
-            if(streq(extensions[i].name, type)) {
-                index = (int)i;
-                break;
-            }
+        for(size_t i = 0; i < rules.types.size(); ++i) {
+            if(rules.matches[i] == rules.memberCounts[i])
+                return FindExtension(rules.types[i].c_str());
         }
 
-        if(index == -1)
-            return -1;
-        
-        return index;
+        return -1;
     }
 
     // Returns the extension ID of an widget
@@ -206,12 +637,7 @@ namespace GUI
                 DumpElement(state);
             }
         } else {
-            for(size_t i = 0; i < extensions.size(); ++i) {
-                if(streq(extensions[i].name, type)) {
-                    extensionIndex = i;
-                    break;
-                }
-            }
+            extensionIndex = FindExtension(type);
 
             if(extensionIndex == -1) {
                 std::cerr << "Unknown layout type \"" << type << "\"" << std::endl;
@@ -246,66 +672,125 @@ namespace GUI
     void MeasureElements(lua_State* state, int32_t* width, int32_t* height);
     int ParseLayout(lua_State* state, Widget* elements);
 
-    void SetDrawRec(Element* element, bool draw, int32_t maxDepth, int32_t currentDepth)
+    // Copies draw, layer and mask of widget to hitFields
+    void MirrorHitFlags(const Widget* widget)
     {
-        if(element->type == WIDGET) {
-            ((Widget*)element)->draw = draw;
-            ++currentDepth;
-        }
-        if(maxDepth == -1 || currentDepth < maxDepth) { 
-            for(size_t i = 0; i < element->children.size(); ++i) {
-                SetDrawRec(element->children[i], draw, maxDepth, currentDepth);
-            }
-        }
+        ++hitGeneration;
+        if(hitGridDirty)
+            return;
+
+        size_t i = widget - widgets.data();
+        if(i >= widgets.size())
+            return;
+
+        hitFields.draw[i] = widget->draw ? -1 : 0;
+        hitFields.layer[i] = widget->layer;
+        hitFields.mask[i] = widget->mask;
     }
-    // Sets whether or not the given widgets should be visible
-    // Depth is increased when a child is a widget
-    void SetDraw(Element* element, bool draw, int32_t depth)
+
+    // Whether widget is within depth of element, counting the widgets between
+    // them. element itself is always within depth, and a depth of -1 is the
+    // whole subtree
+    bool WithinDepth(const Element* element, const Widget& widget, int32_t depth)
     {
-        SetDrawRec(element, draw, depth, 0);
+        return depth == -1 || &widget == element || widget.widgetDepth - element->widgetDepth < depth;
     }
 
-    void SetLayerRec(Element* element, int32_t draw, int32_t maxDepth, int32_t currentDepth)
+    // Sets whether or not the given widgets should be visible
+    // Depth is increased when a child is a widget
+    void SetDraw(Element* element, bool draw, int32_t depth)
     {
-        if(element->type == WIDGET) {
-            ((Widget*)element)->layer = draw;
-            ++currentDepth;
-        }
-        if(maxDepth == -1 || currentDepth < maxDepth) { 
-            for(size_t i = 0; i < element->children.size(); ++i) {
-                SetLayerRec(element->children[i], draw, maxDepth, currentDepth);
+        for(int32_t i = element->firstWidget; i < element->lastWidget; ++i) {
+            Widget& widget = widgets[i];
+            if(WithinDepth(element, widget, depth)) {
+                widget.draw = draw;
+                MirrorHitFlags(&widget);
             }
         }
+        MarkBatchesDirty();
     }
+
+    // Highest layer any widget has been given, popups are placed above it
+    static int32_t maxLayer = 0;
+
     // Sets the layer of the given widgets
     // Depth is increased when a child is a widget
     void SetLayer(Element* element, int32_t layer, int32_t depth)
     {
-        SetLayerRec(element, layer, depth, 0);
+        for(int32_t i = element->firstWidget; i < element->lastWidget; ++i) {
+            Widget& widget = widgets[i];
+            if(WithinDepth(element, widget, depth)) {
+                widget.layer = layer;
+                MirrorHitFlags(&widget);
+            }
+        }
+        maxLayer = std::max(maxLayer, layer);
+        MarkBatchesDirty();
     }
 
     void SetMask(Element* element, int32_t mask)
     {
-        if(element->type == WIDGET) {
-            ((Widget*)element)->mask = mask;
-        }
-        for(size_t i = 0; i < element->children.size(); ++i) {
-            SetMask(element->children[i], mask);
+        for(int32_t i = element->firstWidget; i < element->lastWidget; ++i) {
+            widgets[i].mask = mask;
+            MirrorHitFlags(&widgets[i]);
         }
     }
 
     void SetClipRect(Element* element, uint64_t clipRect)
     {
-        if(element->type == WIDGET) {
-            ((Widget*)element)->clipRect = clipRect;
+        InvalidateHitGrid();
+        MarkBatchesDirty();
+        for(int32_t i = element->firstWidget; i < element->lastWidget; ++i)
+            widgets[i].clipRect = clipRect;
+    }
+
+    void SetClipRect(Element* element, Rect clipRect);
+
+    void TranslateRec(Element* element, float x, float y, bool root)
+    {
+        // Clip rects set inside the subtree move with it. Parents are visited
+        // first, so nested clip rects are set again after their parent's
+        if(!root && element->ownClipRect.Nonzero()) {
+            Rect clipRect = element->ownClipRect;
+            clipRect.x += x;
+            clipRect.y += y;
+            SetClipRect(element, clipRect);
         }
-        for(size_t i = 0; i < element->children.size(); ++i) {
-            SetClipRect(element->children[i], clipRect);
+
+        element->bounds.x += x;
+        element->bounds.y += y;
+        element->builtBounds.x += x;
+        element->builtBounds.y += y;
+
+        if(element->type == WIDGET) {
+            Widget* widget = (Widget*)element;
+            for(int32_t i = 0; i < widget->vertexCount; ++i) {
+                Vertex& vertex = widget->vertices[i];
+                VertexWriter::SetPosition(vertex, vertex.x + x, vertex.y + y);
+            }
+            widget->modified = true;
         }
+
+        for(size_t i = 0; i < element->children.size(); ++i)
+            TranslateRec(element->children[i], x, y, false);
+    }
+
+    // Moves element and everything below it by x, y by offsetting their
+    // bounds and vertices, without rebuilding anything. The clip rect of
+    // element itself belongs to its parent and stays put
+    void Translate(Element* element, float x, float y)
+    {
+        if(x == 0.0f && y == 0.0f)
+            return;
+
+        InvalidateHitGrid();
+        MarkFrameDirty();
+        TranslateRec(element, x, y, true);
     }
 
     void SetClipRect(Element* element, Rect clipRect)
     {
+        element->ownClipRect = clipRect;
         uint64_t packedClipRect = ((uint64_t)clipRect.x & 0xFFFF)
                                     | ((uint64_t)clipRect.y & 0xFFFF) << 16
                                     | ((uint64_t)clipRect.width & 0xFFFF) << 32
@@ -330,20 +815,47 @@ namespace GUI
         return -1;
     }
 
+    // Makes the next build of any ancestor rebuild element
+    void MarkBuildDirty(Element* element)
+    {
+        element->buildDirty = true;
+        for(Element* parent = element->parent; parent && !parent->subtreeDirty; parent = parent->parent)
+            parent->subtreeDirty = true;
+    }
+
+    // Setting a value only makes the element dirty if the extension lets it
+    // be queried, and the queried value changed
     bool SetNumber(Element* element, const char* key, float value)
     {
-        if(extensions[element->extension].setNumberFunction)
-            return extensions[element->extension].setNumberFunction(element, key, value);
-        
-        return false;
+        if(!extensions[element->extension].setNumberFunction)
+            return false;
+
+        float oldValue;
+        float newValue;
+        bool hadValue = QueryNumber(element, key, &oldValue);
+        bool result = extensions[element->extension].setNumberFunction(element, key, value);
+        MarkFrameDirty();
+        if(!hadValue || !QueryNumber(element, key, &newValue) || oldValue != newValue)
+            MarkBuildDirty(element);
+
+        return result;
     }
 
     bool SetString(Element* element, const char* key, const char* value)
     {
-        if(extensions[element->extension].setStringFunction)
-            return extensions[element->extension].setStringFunction(element, key, value);
-        
-        return false;
+        if(!extensions[element->extension].setStringFunction)
+            return false;
+
+        const static int32_t QUERY_LENGTH = 256;
+        char oldValue[QUERY_LENGTH];
+        char newValue[QUERY_LENGTH];
+        bool hadValue = QueryString(element, key, oldValue, QUERY_LENGTH) >= 0;
+        bool result = extensions[element->extension].setStringFunction(element, key, value);
+        MarkFrameDirty();
+        if(!hadValue || QueryString(element, key, newValue, QUERY_LENGTH) < 0 || strcmp(oldValue, newValue) != 0)
+            MarkBuildDirty(element);
+
+        return result;
     }
 
     static std::unordered_map<uint32_t, Character> characters;
@@ -404,7 +916,7 @@ namespace GUI
             Character character = GetCharacter(text[i]);
 
             CreateQuad(widget->vertices + widget->offsetData.vertex + i * 4
-                        , widget->indicies + widget->offsetData.index + i * 6
+                        , widget->indicies ? widget->indicies + widget->offsetData.index + i * 6 : nullptr
                         , widget->offsetData.vertexBegin + i * 4
                         , x + character.xOffset
                         , y + fontHeight - character.yOffset
@@ -505,20 +1017,154 @@ namespace GUI
             mouseOwnElement = nullptr;
     }
 
+    // Widgets with update set, in widget order. Only these get
+    // onUpdateFunction called every frame
+    static std::vector<int32_t> updatingWidgets;
+    void SetUpdate(Widget* widget, bool update)
+    {
+        widget->update = update;
+
+        int32_t index = (int32_t)(widget - widgets.data());
+        auto iter = std::lower_bound(updatingWidgets.begin(), updatingWidgets.end(), index);
+        bool listed = iter != updatingWidgets.end() && *iter == index;
+        if(update && !listed)
+            updatingWidgets.insert(iter, index);
+        else if(!update && listed)
+            updatingWidgets.erase(iter);
+    }
+
+    Element* GetHandleElement(int32_t handle)
+    {
+        if(handle < 0 || handle >= (int32_t)namedElements.size())
+            return nullptr;
+
+        return namedElements[handle];
+    }
+
     Element* GetNamedElement(const char* name)
     {
-        {
-            auto iter = namedWidgets.find(name);
-            if(iter != namedWidgets.end())
-                return &widgets[iter->second];
+        return GetHandleElement(elementNames.Find(name));
+    }
+
+    int32_t GetNameHandle(const char* name)
+    {
+        int32_t handle = elementNames.Intern(name);
+        if(handle >= (int32_t)namedElements.size())
+            namedElements.resize(handle + 1, nullptr);
+
+        return handle;
+    }
+
+    void SetNamedElement(int32_t handle, Element* element)
+    {
+        if(handle == -1)
+            return;
+
+        if(namedElements[handle] == nullptr)
+            namedElements[handle] = element;
+        else
+            std::cerr << "Multiple elements named " << elementNames.Name(handle) << std::endl;
+    }
+
+    // Vertices of all widgets when Settings::vertexArena is set. Drawn
+    // widgets are laid out in draw order, so every draw list is a single
+    // range of the arena. Slots are only moved by LayoutArena
+    struct ArenaSlot
+    {
+        int32_t offset; // -1 if the widget has no slot
+        int32_t capacity;
+        // Vertices in use the last time the slot was drawn. The rest of the
+        // slot is zeroed, making them degenerate quads
+        int32_t vertexCount;
+    };
+    static std::vector<Vertex> arena;
+    static std::vector<ArenaSlot> arenaSlots; // One per widget
+    static std::vector<int32_t> arenaOrder; // Drawn widgets, in the order they are laid out
+    static bool arenaDirty = false; // Set when a widget outgrew its slot
+
+    void PointWidgetsToArena()
+    {
+        for(size_t i = 0; i < arenaSlots.size(); ++i) {
+            if(arenaSlots[i].offset != -1)
+                widgets[i].vertices = arena.data() + arenaSlots[i].offset;
         }
-        {
-            auto iter = namedLayouts.find(name);
-            if(iter != namedLayouts.end())
-                return iter->second;
+    }
+
+    void AllocArenaQuads(Widget* widget, int32_t count)
+    {
+        assert(widget >= widgets.data() && widget < widgets.data() + widgets.size());
+        arenaSlots.resize(widgets.size(), { -1, 0, 0 });
+        ArenaSlot& slot = arenaSlots[widget - widgets.data()];
+
+        widget->vertexCount = count * 4;
+        widget->indexCount = count * 6;
+        widget->indicies = nullptr;
+
+        if(slot.capacity < widget->vertexCount) {
+            // The old slot is left unused until the next LayoutArena
+            slot.offset = (int32_t)arena.size();
+            slot.capacity = widget->vertexCount;
+            slot.vertexCount = 0;
+            arenaDirty = true;
+
+            const Vertex* oldArena = arena.data();
+            arena.resize(arena.size() + slot.capacity);
+            if(arena.data() != oldArena)
+                PointWidgetsToArena();
+        }
+
+        widget->vertices = arena.data() + slot.offset;
+    }
+
+    void AllocQuads(Widget* widget, int32_t count)
+    {
+        MarkBatchesDirty();
+        if(settings.vertexArena) {
+            AllocArenaQuads(widget, count);
+            return;
+        }
+
+        free(widget->vertices);
+        free(widget->indicies);
+
+        widget->vertexCount = count * 4;
+        widget->indexCount = count * 6;
+        widget->vertices = (Vertex*)malloc(sizeof(Vertex) * widget->vertexCount);
+        if(settings.format == DrawListFormat::Vertices && settings.indexMode != IndexMode::SharedQuads)
+            widget->indicies = (uint32_t*)malloc(sizeof(uint32_t) * widget->indexCount);
+        else
+            widget->indicies = nullptr;
+    }
+
+    // Indicies for quadCount quads made by CreateQuad, starting at vertex 0
+    static std::vector<uint32_t> quadIndicies;
+
+    void ReserveQuadIndicies(int32_t quadCount)
+    {
+        int32_t oldQuadCount = (int32_t)quadIndicies.size() / 6;
+        if(quadCount <= oldQuadCount)
+            return;
+
+        quadIndicies.resize(quadCount * 6);
+        for(int32_t i = oldQuadCount; i < quadCount; ++i) {
+            uint32_t* quad = &quadIndicies[i * 6];
+            quad[0] = i * 4;
+            quad[1] = i * 4 + 1;
+            quad[2] = i * 4 + 3;
+            quad[3] = i * 4 + 1;
+            quad[4] = i * 4 + 2;
+            quad[5] = i * 4 + 3;
         }
+    }
+
+    const uint32_t* GetQuadIndicies()
+    {
+        return quadIndicies.data();
+    }
 
-        return nullptr;
+    int32_t GetQuadIndexCount()
+    {
+        return (int32_t)quadIndicies.size();
     }
 
     void BuildLayouts(Element*);
@@ -545,6 +1191,11 @@ namespace GUI
         , StealMouse
         , FreeMouse
         , GetNamedElement
+        , AllocQuads
+        , SetUpdate
+        , Translate
+        , GetNameHandle
+        , GetHandleElement
     };
 
     // These are needed to keep track of if a popup is opened while the mouse is held,
@@ -565,16 +1216,15 @@ namespace GUI
                 parent = hoveredWidget;
         }
 
-        Popup popup = { parent, closeOn, -1, -1, popupWidgetMask };
+        Popup popup = { parent, closeOn, -1, -1, popupWidgetMask, (int32_t)widgets.size(), 0 };
 
-        int32_t layer = 1;
-        for(int32_t i = 0; i < (int32_t)widgets.size(); ++i) {
-            layer = std::max(layer, widgets[i].layer + 1);
-        }
+        int32_t layer = std::max(maxLayer + 1, 1);
         for(int32_t i = 0; i < elementCount; ++i) {
             SetDraw(popupElements[i], true, 1);
             SetLayer(popupElements[i], layer, 1);
             SetMask(popupElements[i], popupWidgetMask);
+            popup.firstWidget = std::min(popup.firstWidget, popupElements[i]->firstWidget);
+            popup.lastWidget = std::max(popup.lastWidget, popupElements[i]->lastWidget);
         }
 
         popupWidgetMask++;
@@ -601,7 +1251,8 @@ namespace GUI
         }
 
         free(widget->data);
-        free(widget->vertices);
+        if(!settings.vertexArena)
+            free(widget->vertices);
         free(widget->indicies);
     }
     
@@ -627,7 +1278,11 @@ namespace GUI
                 extensionPaths.push_back(std::make_pair<std::string, std::string>(extensions[i].name, extensions[i].path));
         }
 
-        DestroyLayouts(rootLayout, state);
+        MarkBatchesDirty();
+        widgetExtents.resize(0);
+        if(rootLayout)
+            DestroyLayouts(rootLayout, state);
+        rootLayout = nullptr;
         for(size_t i = 0; i < preparsedLayouts.size(); ++i) {
             DestroyLayouts(preparsedLayouts[i], state);
         }
@@ -645,24 +1300,37 @@ namespace GUI
 
         if(keepExtensions) {
             extensions.clear();
+            eventHandlers.clear();
             extensions.reserve(extensionPaths.size());
             for(size_t i = 0, size = extensionPaths.size(); i < size; ++i)
                 RegisterSharedLibrary(&extensionPaths[i].first[0], &extensionPaths[i].second[0]);
         } else {
             extensions.clear();
+            eventHandlers.clear();
         }
 
 #ifdef VALGRIND
         }
 #endif
 
-        vertices.resize(0);
         drawLists.resize(0);
+        assembledDrawLists.resize(0);
+        groupWidgets.resize(0);
+        ++frameGeneration;
+        batches.resize(0);
+        batchOrder.resize(0);
+        batchLookup.clear();
+        batchGroups.resize(0);
+        batchGroupCount = 0;
+        InvalidateHitGrid();
+        arena.resize(0);
+        arenaSlots.resize(0);
+        arenaOrder.resize(0);
+        arenaDirty = false;
         widgets.resize(0);
-        typeInferInfo.resize(0);
+        typeInferRules = TypeInferRules { {}, {}, NameTable(), {}, 0, {} };
         popups.resize(0);
-        namedWidgets.clear();
-        namedLayouts.clear();
+        std::fill(namedElements.begin(), namedElements.end(), nullptr);
         while(!defaultsStack.empty()) {
             if(defaultsStack.top() != -1) // I don't think -1 is a valid ref index?
                 luaL_unref(state, LUA_REGISTRYINDEX, defaultsStack.top());
@@ -671,6 +1339,9 @@ namespace GUI
 
         hoveredWidget = -1;
         downWidget = -1;
+        maxLayer = 0;
+        statistics = Statistics();
+        updatingWidgets.resize(0);
     }
 
     void ClosePopups(lua_State* state, int32_t count)
@@ -678,18 +1349,20 @@ namespace GUI
         if(count > (int32_t)popups.size())
             count = popups.size();
 
+        if(count > 0)
+            MarkBatchesDirty();
+
         for(int32_t i = 0; i < count; ++i) {
-            //for(int32_t j = 0; j < popups.back().widgetCount; ++j) {
-            for(int32_t j = 0; j < (int32_t)widgets.size(); ++j) {
+            for(int32_t j = popups.back().firstWidget; j < popups.back().lastWidget; ++j) {
                 Widget* widget = &widgets[j];
                 if(widget->mask != popups.back().widgetMask)
                     continue;
 
-                if(extensions[widget->extension].onExitFunction) {
-                    extensions[widget->extension].onExitFunction(widget, state);
-                }
+                if(HasCapability(widget, ON_EXIT))
+                    eventHandlers[widget->extension].onExit(widget, state);
                 widget->draw = false;
                 widget->mask = -1;
+                MirrorHitFlags(widget);
             }
 
             if(popups.back().parent != -1) {
@@ -743,12 +1416,38 @@ namespace GUI
         return returnInfo;
     }
 
-    void ShallowCopyInto(lua_State* state)
+    TypeInferRules CompileTypeInferRules(const std::vector<TypeInferInfo>& infos)
     {
-        // dest, source
-        lua_pushnil(state);
-        // dest, source, nil
-        while(lua_next(state, -2)) {
+        TypeInferRules rules = { {}, {}, NameTable(), {}, (infos.size() + 63) / 64, {} };
+        rules.matches.resize(infos.size(), 0);
+
+        for(size_t i = 0; i < infos.size(); ++i) {
+            rules.types.push_back(infos[i].type);
+            rules.memberCounts.push_back(0);
+
+            for(const std::string& member : infos[i].members) {
+                int32_t key = rules.keys.Intern(member.c_str());
+                rules.keyRules.resize(rules.keys.Size() * rules.words, 0);
+
+                uint64_t& word = rules.keyRules[key * rules.words + i / 64];
+                uint64_t bit = (uint64_t)1 << (i % 64);
+                // Members listed twice only have to be present once
+                if((word & bit) == 0) {
+                    word |= bit;
+                    ++rules.memberCounts.back();
+                }
+            }
+        }
+
+        return rules;
+    }
+
+    void ShallowCopyInto(lua_State* state)
+    {
+        // dest, source
+        lua_pushnil(state);
+        // dest, source, nil
+        while(lua_next(state, -2)) {
             // Duplicate key and keep one, insert key and value into new table
             // dest, source, key, value
             lua_pushvalue(state, -2);
@@ -762,6 +1461,38 @@ namespace GUI
 
     static std::vector<Element*> layoutsStack;
 
+    int32_t ChildWidgetDepth(const Element* parent)
+    {
+        return parent->widgetDepth + (parent->type == WIDGET ? 1 : 0);
+    }
+
+    // Finds the nearest ancestors handling bubbled events, element's parent
+    // and extension have to be set
+    void SetEventHandlers(Element* element)
+    {
+        Element* parent = element->parent;
+        if(!parent) {
+            element->childClickedHandler = nullptr;
+            element->childReleasedHandler = nullptr;
+            element->childUpdateHandler = nullptr;
+            element->scrollHandler = nullptr;
+            return;
+        }
+
+        element->childClickedHandler = HasCapability(parent, ON_CHILD_CLICKED) ? parent : parent->childClickedHandler;
+        element->childReleasedHandler = HasCapability(parent, ON_CHILD_RELEASED) ? parent : parent->childReleasedHandler;
+        element->childUpdateHandler = HasCapability(parent, ON_CHILD_UPDATE) ? parent : parent->childUpdateHandler;
+        element->scrollHandler = HasCapability(parent, ON_SCROLL) ? parent : parent->scrollHandler;
+    }
+
+    // firstParsed is where parsing of element started, and parsedCount what
+    // its parse function returned
+    void SetWidgetRange(Element* element, const Widget* firstParsed, int parsedCount)
+    {
+        element->firstWidget = (int32_t)(firstParsed - GUI::widgets.data());
+        element->lastWidget = element->firstWidget + std::max(parsedCount, 0);
+    }
+
     int ParseLayout(lua_State* state, Widget* widgets)
     {
         int extensionIndex = GetExtension(state);
@@ -786,9 +1517,9 @@ namespace GUI
         if(!defaultsStack.empty())
             defaults = defaultsStack.top();
 
-        std::string name;
+        int32_t nameHandle = -1;
         if(FieldExists(state, "name")) {
-            name = lua_tostring(state, -1);
+            nameHandle = GetNameHandle(lua_tostring(state, -1));
             lua_pop(state, 1);
         }
 
@@ -800,66 +1531,78 @@ namespace GUI
             newLayout->data = nullptr;
             newLayout->parent = nullptr;
             newLayout->bounds = { 0.0f, 0.0f, 0.0f, 0.0f };
+            newLayout->widgetDepth = 0;
             if(!layoutsStack.empty()) {
                 layoutsStack.back()->children.push_back(newLayout);
                 pop = true;
 
                 if(!layoutsStack.empty()) {
                     newLayout->parent = layoutsStack.back();
+                    newLayout->widgetDepth = ChildWidgetDepth(newLayout->parent);
                 }
             }
+            SetEventHandlers(newLayout);
+            newLayout->builtBounds = { 0.0f, 0.0f, 0.0f, 0.0f };
+            newLayout->buildDirty = true;
+            newLayout->subtreeDirty = false;
+            newLayout->ownClipRect = { 0.0f, 0.0f, 0.0f, 0.0f };
             layoutsStack.push_back(newLayout);
 
             returnValue = extensions[extensionIndex].parseLayoutFunction(state, newLayout, widgets, defaults);
+            SetWidgetRange(newLayout, widgets, returnValue);
 
             if(pop)
                 layoutsStack.pop_back();
 
-            if(!name.empty()) {
-                auto widgetIter = namedWidgets.find(name);
-                auto layoutIter = namedLayouts.find(name);
-                if(widgetIter == namedWidgets.end() && layoutIter == namedLayouts.end()) {
-                    namedLayouts[name] = newLayout;
-                } else {
-                    std::cerr << "Multiple elements named " << name << std::endl;
+            SetNamedElement(nameHandle, newLayout);
+        } else {
+            // BuildGUI gives up on the GUI once it is done parsing
+            size_t index = widgets - GUI::widgets.data();
+            if(index >= GUI::widgets.size() && !GUI::widgets.resize(index + 1)) {
+                if(pushedDefaults) {
+                    luaL_unref(state, LUA_REGISTRYINDEX, defaultsStack.top());
+                    defaultsStack.pop();
                 }
+                return 0;
             }
-        } else {
+
             widgets->draw = true;
             widgets->update = false;
             widgets->modified = false;
             widgets->layer = 0;
             widgets->extension = extensionIndex;
             widgets->vertices = nullptr;
+            widgets->indicies = nullptr;
             widgets->data = nullptr;
             widgets->vertexCount = 0;
+            widgets->indexCount = 0;
             widgets->parent = nullptr;
             widgets->mask = -1;
             widgets->clipRect = 0;
             widgets->offsetData = { 0, 0, 0 };
             widgets->bounds = { 0.0f, 0.0f, 0.0f, 0.0f };
+            widgets->widgetDepth = 0;
 
             if(!layoutsStack.empty()) {
                 widgets->parent = layoutsStack.back();
+                widgets->widgetDepth = ChildWidgetDepth(widgets->parent);
             }
+            SetEventHandlers(widgets);
+            widgets->builtBounds = { 0.0f, 0.0f, 0.0f, 0.0f };
+            widgets->buildDirty = true;
+            widgets->subtreeDirty = false;
+            widgets->ownClipRect = { 0.0f, 0.0f, 0.0f, 0.0f };
 
             layoutsStack.push_back(widgets);
 
             returnValue = extensions[extensionIndex].parseWidgetFunction(state, widgets, defaults);
+            SetWidgetRange(widgets, widgets, returnValue);
 
             layoutsStack.pop_back();
 
             layoutsStack.back()->children.push_back(widgets);
 
-            if(!name.empty()) {
-                auto widgetIter = namedWidgets.find(name);
-                auto layoutIter = namedLayouts.find(name);
-                if(widgetIter == namedWidgets.end() && layoutIter == namedLayouts.end()) {
-                    namedWidgets[name] = (int32_t)(GUI::widgets.data() - widgets);
-                } else {
-                    std::cerr << "Multiple elements named " << name << std::endl;
-                }
-            }
+            SetNamedElement(nameHandle, widgets);
         }
 
         if(pushedDefaults) {
@@ -870,27 +1613,97 @@ namespace GUI
         return returnValue;
     }
 
-    void BuildLayouts(Element* element)
+    void BuildLayoutsRec(Element* element, bool force)
     {
-        if(element->type == LAYOUT) {
-            extensions[element->extension].buildLayoutFunction((Layout*)element, element->children.data(), (int32_t)element->children.size());
-        } else {
-            Widget* guiWidget = (Widget*)element;
-            guiWidget->modified = true;
-            if(!element->children.empty())
-                extensions[element->extension].buildChildrenFunction((Widget*)element, element->children.data(), (int32_t)element->children.size());
+        const Rect& bounds = element->bounds;
+        const Rect& builtBounds = element->builtBounds;
+        bool rebuild = force
+            || element->buildDirty
+            || bounds.x != builtBounds.x
+            || bounds.y != builtBounds.y
+            || bounds.width != builtBounds.width
+            || bounds.height != builtBounds.height;
+
+        if(rebuild) {
+            if(element->type == LAYOUT) {
+                extensions[element->extension].buildLayoutFunction((Layout*)element, element->children.data(), (int32_t)element->children.size());
+            } else {
+                Widget* guiWidget = (Widget*)element;
+                guiWidget->modified = true;
+                if(!element->children.empty())
+                    extensions[element->extension].buildChildrenFunction((Widget*)element, element->children.data(), (int32_t)element->children.size());
 
-            ((Widget*)element)->offsetData = { 0, 0, 0 };
-            extensions[element->extension].buildWidgetFunction((Widget*)element);
+                ((Widget*)element)->offsetData = { 0, 0, 0 };
+                extensions[element->extension].buildWidgetFunction((Widget*)element);
+            }
+
+            element->builtBounds = element->bounds;
+            element->buildDirty = false;
         }
 
-        for(int32_t i = 0; i < (int32_t)element->children.size(); ++i) {
-            BuildLayouts(element->children[i]);
+        // Children only get new bounds when their parent is rebuilt
+        if(rebuild || element->subtreeDirty) {
+            for(int32_t i = 0; i < (int32_t)element->children.size(); ++i) {
+                BuildLayoutsRec(element->children[i], false);
+            }
         }
+        element->subtreeDirty = false;
+    }
+
+    // Builds element, and every descendant whose bounds or data changed
+    void BuildLayouts(Element* element)
+    {
+        InvalidateHitGrid();
+        MarkFrameDirty();
+        BuildLayoutsRec(element, true);
+    }
+
+    // Registry reference to a table mapping measured Lua tables to
+    // { width, height }. Only exists while BuildGUI counts and parses. The
+    // keys are weak, so a collected table's size is never reused for a new
+    // table at the same address
+    static int measureCache = LUA_NOREF;
+
+    void BeginMeasureCache(lua_State* state)
+    {
+        lua_newtable(state);
+        lua_newtable(state);
+        lua_pushstring(state, "__mode");
+        lua_pushstring(state, "k");
+        lua_settable(state, -3);
+        lua_setmetatable(state, -2);
+        measureCache = luaL_ref(state, LUA_REGISTRYINDEX);
+
+        statistics.measureHits = 0;
+        statistics.measureMisses = 0;
+    }
+
+    void EndMeasureCache(lua_State* state)
+    {
+        luaL_unref(state, LUA_REGISTRYINDEX, measureCache);
+        measureCache = LUA_NOREF;
     }
 
     void MeasureElements(lua_State* state, int32_t* width, int32_t* height)
     {
+        const bool useCache = measureCache != LUA_NOREF && lua_istable(state, -1);
+        if(useCache) {
+            lua_rawgeti(state, LUA_REGISTRYINDEX, measureCache);
+            lua_pushvalue(state, -2);
+            lua_rawget(state, -2);
+            if(lua_istable(state, -1)) {
+                lua_rawgeti(state, -1, 1);
+                lua_rawgeti(state, -2, 2);
+                *width = (int32_t)lua_tonumber(state, -2);
+                *height = (int32_t)lua_tonumber(state, -1);
+                lua_pop(state, 4);
+                ++statistics.measureHits;
+                return;
+            }
+            lua_pop(state, 2);
+            ++statistics.measureMisses;
+        }
+
         int extensionIndex = GetExtension(state);
         if(extensionIndex == -1)
             return;
@@ -901,6 +1714,18 @@ namespace GUI
             *width = -1;
             *height = -1;
         }
+
+        if(useCache) {
+            lua_rawgeti(state, LUA_REGISTRYINDEX, measureCache);
+            lua_pushvalue(state, -2);
+            lua_createtable(state, 2, 0);
+            lua_pushnumber(state, *width);
+            lua_rawseti(state, -2, 1);
+            lua_pushnumber(state, *height);
+            lua_rawseti(state, -2, 2);
+            lua_rawset(state, -3);
+            lua_pop(state, 1);
+        }
     }
 
     int CountElements(lua_State* state)
@@ -915,12 +1740,28 @@ namespace GUI
             return 1;
     }
 
+    // Counts the widgets of the layout on top of the stack and of every
+    // preparsed layout
+    int CountAllElements(lua_State* state)
+    {
+        int count = CountElements(state);
+        lua_getglobal(state, "preparse_layouts");
+        if(!lua_isnil(state, -1)) {
+            lua_pushnil(state);
+            while(lua_next(state, -2)) {
+                count += CountElements(state);
+                lua_pop(state, 1);
+            }
+        }
+        lua_pop(state, 1);
+        return count;
+    }
+
     void BuildGUI(lua_State* state)
     {
         Timer timer;
         Timer destroyTime;
         Timer luaTime;
-        Timer countTime;
         Timer parseTime;
         Timer buildLayoutsTime;
         timer.Start();
@@ -953,34 +1794,29 @@ namespace GUI
         } else {
             lua_getglobal(state, "inferred");
             if(!lua_isnil(state, -1)) {
-                typeInferInfo = ParseTypeInferInfo(state);
+                typeInferRules = CompileTypeInferRules(ParseTypeInferInfo(state));
             }
             lua_pop(state, 1);
 
             lua_getglobal(state, "layout");
             if(!lua_isnil(state, -1)) {
-                countTime.Start();
-                int widgetCount = CountElements(state);
-
+                BeginMeasureCache(state);
+                parseTime.Start();
+
+                // widgets grows while parsing, see WidgetStore. data() finds
+                // out whether that is possible
+                widgets.data();
+                if(widgets.counted)
+                    widgets.Allocate(CountAllElements(state));
                 lua_getglobal(state, "preparse_layouts");
                 int offset = 0;
                 if(!lua_isnil(state, -1)) {
-                    lua_pushnil(state);
-                    while(lua_next(state, -2)) {
-                        widgetCount += CountElements(state);
-                        lua_pop(state, 1);
-                    }
-                    countTime.Stop();
-
-                    widgets.resize(widgetCount);
-
-                    parseTime.Start();
                     lua_pushnil(state);
                     while(lua_next(state, -2)) {
                         lua_pushstring(state, "name");
                         lua_pushstring(state, lua_tostring(state, -3));
                         lua_settable(state, -3);
-                        offset += ParseLayout(state, &widgets[offset]);
+                        offset += ParseLayout(state, widgets.data() + offset);
                         preparsedLayouts.push_back((Layout*)layoutsStack.back());
                         layoutsStack.pop_back();
                         lua_pop(state, 1);
@@ -988,10 +1824,6 @@ namespace GUI
 
                     for(int i = 0; i < offset; ++i)
                         widgets[i].draw = false;
-                } else {
-                    countTime.Stop();
-                    widgets.resize(widgetCount);
-                    parseTime.Start();
                 }
                 lua_pop(state, 1);
 
@@ -999,6 +1831,26 @@ namespace GUI
                 ParseLayout(state, widgets.data() + offset);
                 lua_pop(state, 1);
                 parseTime.Stop();
+                EndMeasureCache(state);
+
+                if(widgets.overflowed) {
+                    bool retry = !widgets.counted;
+                    if(retry)
+                        std::cerr << "More than " << WidgetStore::MAX_WIDGETS << " widgets, counting them before parsing instead" << std::endl;
+                    else
+                        std::cerr << "Couldn't store every widget. The GUI will not be built" << std::endl;
+
+                    if(!layoutsStack.empty()) {
+                        rootLayout = (Layout*)layoutsStack.back();
+                        layoutsStack.pop_back();
+                    }
+                    DestroyGUI(state, true);
+                    if(retry) {
+                        widgets.Allocate(0);
+                        BuildGUI(state);
+                    }
+                    return;
+                }
 
                 if(layoutsStack.empty())
                     return;
@@ -1015,14 +1867,15 @@ namespace GUI
             }
 
             timer.Stop();
-            printf("GUI build time: %f\n\tDestroy: %f\n\tLua: %f\n\tCount: %f\n\tParse: %f\n\tBuild layouts: %f\n\tTotalBuild: %f\n"
+            printf("GUI build time: %f\n\tDestroy: %f\n\tLua: %f\n\tParse: %f\n\tBuild layouts: %f\n\tTotalBuild: %f\n\tMeasure cache hits: %d/%d\n"
                         , timer.GetTimeMillisecondsFraction()
                         , destroyTime.GetTimeMillisecondsFraction()
                         , luaTime.GetTimeMillisecondsFraction()
-                        , countTime.GetTimeMillisecondsFraction()
                         , parseTime.GetTimeMillisecondsFraction()
                         , buildLayoutsTime.GetTimeMillisecondsFraction()
-                        , timer.GetTimeMillisecondsFraction() - destroyTime.GetTimeMillisecondsFraction());
+                        , timer.GetTimeMillisecondsFraction() - destroyTime.GetTimeMillisecondsFraction()
+                        , statistics.measureHits
+                        , statistics.measureHits + statistics.measureMisses);
         }
     }
 
@@ -1091,6 +1944,11 @@ namespace GUI
         }
     }
 
+    int GetReloadHandle()
+    {
+        return autoReload ? inotifyHandle : -1;
+    }
+
     void RegisterSharedLibrary(const char* name, const char* path)
     {
         void* lib = dlopen(path, RTLD_NOW);
@@ -1136,8 +1994,34 @@ namespace GUI
             std::strcpy(&extension.name[0], name);
             extension.libraryHandle = lib;
             extensions.push_back(extension);
+            UpdateExtensionNames();
             std::strcpy(&extensions.back().path[0], path);
 
+            EventHandlers handlers = {
+                0
+                , extension.onEnterFunction
+                , extension.onExitFunction
+                , extension.onClickFunction
+                , extension.onReleaseInsideFunction
+                , extension.onReleaseOutsideFunction
+                , extension.onScrollFunction
+                , extension.onUpdateFunction
+                , extension.onChildClickedFunction
+                , extension.onChildReleasedFunction
+                , extension.onChildUpdateFunction
+            };
+            handlers.capabilities = (handlers.onEnter ? ON_ENTER : 0)
+                | (handlers.onExit ? ON_EXIT : 0)
+                | (handlers.onClick ? ON_CLICK : 0)
+                | (handlers.onReleaseInside ? ON_RELEASE_INSIDE : 0)
+                | (handlers.onReleaseOutside ? ON_RELEASE_OUTSIDE : 0)
+                | (handlers.onScroll ? ON_SCROLL : 0)
+                | (handlers.onUpdate ? ON_UPDATE : 0)
+                | (handlers.onChildClicked ? ON_CHILD_CLICKED : 0)
+                | (handlers.onChildReleased ? ON_CHILD_RELEASED : 0)
+                | (handlers.onChildUpdate ? ON_CHILD_UPDATE : 0);
+            eventHandlers.push_back(handlers);
+
             if(extension.initFunction)
                 extension.initFunction(GetFontHeight(), &initFunctions);
         }
@@ -1149,6 +2033,8 @@ namespace GUI
             if(streq(extensions[i].name, name)) {
                 dlclose(extensions[i].path);
                 extensions.erase(extensions.begin() + i);
+                eventHandlers.erase(eventHandlers.begin() + i);
+                UpdateExtensionNames();
                 return;
             }
         }
@@ -1172,10 +2058,16 @@ namespace GUI
         return fontImageHeight;
     }
 
-    void InitGUI(size_t resolutionX, size_t resolutionY)
+    void InitGUI(size_t resolutionX, size_t resolutionY, const Settings& settings/*= Settings()*/)
     {
         GUI::resolutionX = resolutionX;
         GUI::resolutionY = resolutionY;
+        GUI::settings = settings;
+        MarkBatchesDirty();
+        if(settings.vertexArena && (settings.format != DrawListFormat::Vertices || settings.indexMode != IndexMode::SharedQuads)) {
+            std::cerr << "The vertex arena requires DrawListFormat::Vertices and IndexMode::SharedQuads, it will not be used" << std::endl;
+            GUI::settings.vertexArena = false;
+        }
 
         fontImageData.resize(512 * 512 * 4, 0);
         CreateFont("content/UbuntuMono-R.ttf", fontImageData.data(), fontImageWidth, fontImageHeight);
@@ -1185,63 +2077,226 @@ namespace GUI
     {
         GUI::resolutionX = width;
         GUI::resolutionY = height;
+        InvalidateHitGrid();
+
+        // Only the root's bounds depend on the resolution, so the parsed GUI
+        // is kept and laid out again. Elements whose bounds don't change
+        // aren't rebuilt. Popups are placed relative to where they were
+        // opened, so they are closed like a rebuild would
+        if(rootLayout) {
+            ClosePopups(state, popups.size());
+            rootLayout->bounds = { 0.0f, 0.0f, (float)width, (float)height };
+            BuildLayouts(rootLayout);
+        } else {
+            BuildGUI(state);
+        }
+    }
 
-        BuildGUI(state);
+    void BuildHitGrid()
+    {
+        hitGrid.columns = std::max((int32_t)(resolutionX + HIT_GRID_CELL_SIZE - 1) / HIT_GRID_CELL_SIZE, 1);
+        hitGrid.rows = std::max((int32_t)(resolutionY + HIT_GRID_CELL_SIZE - 1) / HIT_GRID_CELL_SIZE, 1);
+        hitGrid.cellStart.assign(hitGrid.columns * hitGrid.rows + 1, 0);
+
+        size_t paddedCount = (widgets.size() + 3) & ~(size_t)3;
+        hitFields.minX.assign(paddedCount, 0.0f);
+        hitFields.minY.assign(paddedCount, 0.0f);
+        hitFields.maxX.assign(paddedCount, -1.0f);
+        hitFields.maxY.assign(paddedCount, -1.0f);
+        hitFields.draw.assign(paddedCount, 0);
+        hitFields.layer.assign(paddedCount, 0);
+        hitFields.mask.assign(paddedCount, -1);
+
+        // Cell ranges of every widget, min column, min row, max column, max row.
+        // Ranges with a min above the max are empty
+        static std::vector<int32_t> ranges;
+        ranges.resize(widgets.size() * 4);
+        for(int32_t i = 0; i < (int32_t)widgets.size(); ++i) {
+            const Widget& widget = widgets[i];
+            float minX = widget.bounds.x;
+            float minY = widget.bounds.y;
+            float maxX = widget.bounds.x + widget.bounds.width;
+            float maxY = widget.bounds.y + widget.bounds.height;
+            if(widget.clipRect != 0) {
+                Rect clipRect = UnpackClipRect(widget.clipRect);
+                minX = std::max(minX, clipRect.x);
+                minY = std::max(minY, clipRect.y);
+                maxX = std::min(maxX, clipRect.x + clipRect.width);
+                maxY = std::min(maxY, clipRect.y + clipRect.height);
+            }
+
+            hitFields.minX[i] = minX;
+            hitFields.minY[i] = minY;
+            hitFields.maxX[i] = maxX;
+            hitFields.maxY[i] = maxY;
+            hitFields.draw[i] = widget.draw ? -1 : 0;
+            hitFields.layer[i] = widget.layer;
+            hitFields.mask[i] = widget.mask;
+
+            int32_t* range = &ranges[i * 4];
+            if(minX > maxX || minY > maxY || maxX < 0.0f || maxY < 0.0f) {
+                range[0] = range[1] = 0;
+                range[2] = range[3] = -1;
+                continue;
+            }
+            range[0] = std::min((int32_t)std::max(minX, 0.0f) / HIT_GRID_CELL_SIZE, hitGrid.columns - 1);
+            range[1] = std::min((int32_t)std::max(minY, 0.0f) / HIT_GRID_CELL_SIZE, hitGrid.rows - 1);
+            range[2] = std::min((int32_t)maxX / HIT_GRID_CELL_SIZE, hitGrid.columns - 1);
+            range[3] = std::min((int32_t)maxY / HIT_GRID_CELL_SIZE, hitGrid.rows - 1);
+
+            for(int32_t row = range[1]; row <= range[3]; ++row) {
+                for(int32_t column = range[0]; column <= range[2]; ++column)
+                    ++hitGrid.cellStart[row * hitGrid.columns + column + 1];
+            }
+        }
+
+        for(size_t i = 1; i < hitGrid.cellStart.size(); ++i)
+            hitGrid.cellStart[i] += hitGrid.cellStart[i - 1];
+
+        // Filled in widget order, so every cell ends up sorted
+        static std::vector<int32_t> cellEnd;
+        cellEnd.assign(hitGrid.cellStart.begin(), hitGrid.cellStart.end() - 1);
+        hitGrid.entries.resize(hitGrid.cellStart.back());
+        for(int32_t i = 0; i < (int32_t)widgets.size(); ++i) {
+            const int32_t* range = &ranges[i * 4];
+            for(int32_t row = range[1]; row <= range[3]; ++row) {
+                for(int32_t column = range[0]; column <= range[2]; ++column)
+                    hitGrid.entries[cellEnd[row * hitGrid.columns + column]++] = i;
+            }
+        }
+
+        hitGridDirty = false;
+    }
+
+    struct HitQuery
+    {
+        float x;
+        float y;
+        const int32_t* mask;
+        bool useLayers;
+
+        int32_t layer;
+        int32_t hit;
+    };
+
+    bool HitsWidget(const HitQuery& query, int32_t widget)
+    {
+        return hitFields.draw[widget]
+            && (!query.mask || hitFields.mask[widget] == *query.mask)
+            && query.x >= hitFields.minX[widget] && query.x <= hitFields.maxX[widget]
+            && query.y >= hitFields.minY[widget] && query.y <= hitFields.maxY[widget];
+    }
+
+    // Called in widget order for every widget that is hit
+    void AcceptHit(HitQuery& query, int32_t widget)
+    {
+        if(query.useLayers) {
+            if(hitFields.layer[widget] < query.layer)
+                return;
+            query.layer = hitFields.layer[widget];
+        }
+        query.hit = widget;
+    }
+
+    // Tests every widget, 4 at a time when SSE2 is available
+    void HitTestAll(HitQuery& query)
+    {
+        int32_t count = (int32_t)hitFields.draw.size();
+#ifdef __SSE2__
+        const __m128 x = _mm_set1_ps(query.x);
+        const __m128 y = _mm_set1_ps(query.y);
+        const __m128i mask = _mm_set1_epi32(query.mask ? *query.mask : 0);
+        const __m128i ignoreMask = _mm_set1_epi32(query.mask ? 0 : -1);
+
+        for(int32_t i = 0; i < count; i += 4) {
+            __m128 inside = _mm_and_ps(
+                _mm_and_ps(_mm_cmpge_ps(x, _mm_loadu_ps(&hitFields.minX[i])), _mm_cmple_ps(x, _mm_loadu_ps(&hitFields.maxX[i])))
+                , _mm_and_ps(_mm_cmpge_ps(y, _mm_loadu_ps(&hitFields.minY[i])), _mm_cmple_ps(y, _mm_loadu_ps(&hitFields.maxY[i]))));
+            __m128i accepted = _mm_and_si128(_mm_castps_si128(inside), _mm_loadu_si128((const __m128i*)&hitFields.draw[i]));
+            accepted = _mm_and_si128(accepted, _mm_or_si128(ignoreMask, _mm_cmpeq_epi32(mask, _mm_loadu_si128((const __m128i*)&hitFields.mask[i]))));
+
+            int lanes = _mm_movemask_ps(_mm_castsi128_ps(accepted));
+            for(int32_t j = 0; lanes != 0; ++j, lanes >>= 1) {
+                if(lanes & 1)
+                    AcceptHit(query, i + j);
+            }
+        }
+#else
+        for(int32_t i = 0; i < count; ++i) {
+            if(HitsWidget(query, i))
+                AcceptHit(query, i);
+        }
+#endif
+    }
+
+    // Returns the widget at x, y, or -1 if there is none. If mask isn't
+    // nullptr only widgets with that mask are considered. If useLayers is set,
+    // widgets on layers below 0 are ignored and the highest layer wins.
+    // Otherwise, and between widgets on the same layer, the last widget wins
+    int32_t WidgetAt(int32_t x, int32_t y, const int32_t* mask, bool useLayers)
+    {
+        if(hitGridDirty)
+            BuildHitGrid();
+
+        HitQuery query = { (float)x, (float)y, mask, useLayers, 0, -1 };
+
+        int32_t column = x / HIT_GRID_CELL_SIZE;
+        int32_t row = y / HIT_GRID_CELL_SIZE;
+        if(x < 0 || y < 0 || column >= hitGrid.columns || row >= hitGrid.rows) {
+            // Off screen, every widget has to be checked
+            HitTestAll(query);
+            return query.hit;
+        }
+
+        int32_t cell = row * hitGrid.columns + column;
+        int32_t first = hitGrid.cellStart[cell];
+        int32_t last = hitGrid.cellStart[cell + 1];
+        if((last - first) * 4 >= (int32_t)widgets.size()) {
+            // Most widgets overlap this cell, e.g. a long scroll list, so
+            // testing all of them with SIMD is cheaper than going through the cell
+            HitTestAll(query);
+            return query.hit;
+        }
+
+        for(int32_t i = first; i < last; ++i) {
+            int32_t widget = hitGrid.entries[i];
+            if(HitsWidget(query, widget))
+                AcceptHit(query, widget);
+        }
+
+        return query.hit;
     }
 
     void MouseDown(lua_State* state, int32_t x, int32_t y)
     {
+        MarkFrameDirty();
         mouseDown = true;
-        int32_t widgetLayer = 0;
 
         Widget* newDownWidget = nullptr;
 
         if(popups.empty()) {
-            for(int32_t i = 0; i < (int32_t)widgets.size(); ++i) {
-                Widget& widget = widgets[i];
-                if(widget.draw) {
-                    const Rect bounds = widget.bounds;
-                    const Rect clipRect = UnpackClipRect(widget.clipRect);
-                    if(bounds.Contains(x, y)
-                        && (!clipRect.Nonzero() || (clipRect.Nonzero() && clipRect.Contains(x, y)))
-                        && widgets[i].layer >= widgetLayer)
-                    {
-                        downWidget = i;
-                        widgetLayer = widgets[i].layer;
-                        newDownWidget = &widget;
-                    }
-                }
+            int32_t hit = WidgetAt(x, y, nullptr, true);
+            if(hit != -1) {
+                downWidget = hit;
+                newDownWidget = &widgets[hit];
             }
         } else {
-            for(int32_t i = 0; i < (int32_t)widgets.size(); ++i) {
-                Widget* widget = &widgets[i];
-                if(widget->draw) {
-                    const Rect bounds = widget->bounds;
-                    const Rect clipRect = UnpackClipRect(widget->clipRect);
-                    if(widget->mask == popups.back().widgetMask
-                        && (!clipRect.Nonzero() || (clipRect.Nonzero() && clipRect.Contains(x, y)))
-                        && bounds.Contains(x, y))
-                    {
-                        popups.back().downWidget = i;
-                        newDownWidget = widget;
-                    }
-                }
+            int32_t hit = WidgetAt(x, y, &popups.back().widgetMask, false);
+            if(hit != -1) {
+                popups.back().downWidget = hit;
+                newDownWidget = &widgets[hit];
             }
         }
 
         if(newDownWidget) {
-            if(extensions[newDownWidget->extension].onClickFunction) {
-                Element* parent = newDownWidget->parent;
-                if(extensions[newDownWidget->extension].onClickFunction(newDownWidget, state, x, y))
-                {
-                    while(parent) {
-                        if(extensions[parent->extension].onChildClickedFunction
-                            && extensions[parent->extension].onChildClickedFunction(parent, state, newDownWidget, x, y))
-                        {
-                            break;
-                        }
-                        parent = parent->parent;
-                    }
+            if(HasCapability(newDownWidget, ON_CLICK)
+                && eventHandlers[newDownWidget->extension].onClick(newDownWidget, state, x, y))
+            {
+                Element* parent = newDownWidget->childClickedHandler;
+                while(parent) {
+                    if(eventHandlers[parent->extension].onChildClicked(parent, state, newDownWidget, x, y))
+                        break;
+                    parent = parent->childClickedHandler;
                 }
             }
         } else {
@@ -1252,55 +2307,28 @@ namespace GUI
 
     void Scroll(lua_State* state, int32_t mouseX, int32_t mouseY, int32_t scrollX, int32_t scrollY)
     {
-        int32_t hoverWidget = -1;
-        if(popups.empty()) {
-            int32_t widgetLayer = 0;
-            for(int32_t i = 0; i < (int32_t)widgets.size(); ++i) {
-                Widget& widget = widgets[i];
-                if(widget.draw) {
-                    const Rect bounds = widget.bounds;
-                    const Rect clipRect = UnpackClipRect(widget.clipRect);
-                    if(bounds.Contains(mouseX, mouseY)
-                        && (!clipRect.Nonzero() || (clipRect.Nonzero() && clipRect.Contains(mouseX, mouseY)))
-                        && widgets[i].layer >= widgetLayer)
-                    {
-                        hoverWidget = i;
-                        widgetLayer = widgets[i].layer;
-                    }
-                }
-            }
-        } else {
-            for(int32_t i = 0; i < (int32_t)widgets.size(); ++i) {
-                Widget* widget = &widgets[i];
-                if(widget->draw) {
-                    const Rect bounds = widget->bounds;
-                    const Rect clipRect = UnpackClipRect(widget->clipRect);
-                    if(widget->mask == popups.back().widgetMask
-                        && (!clipRect.Nonzero() || (clipRect.Nonzero() && clipRect.Contains(mouseX, mouseY)))
-                        && bounds.Contains(mouseX, mouseY))
-                    {
-                        hoverWidget = i;
-                    }
-                }
-            }
-        }
+        MarkFrameDirty();
+        int32_t hoverWidget;
+        if(popups.empty())
+            hoverWidget = WidgetAt(mouseX, mouseY, nullptr, true);
+        else
+            hoverWidget = WidgetAt(mouseX, mouseY, &popups.back().widgetMask, false);
 
         if(hoverWidget != -1) {
             Element* element = &widgets[hoverWidget];
-            while(element)
-            {
-                if(extensions[element->extension].onScrollFunction
-                    && extensions[element->extension].onScrollFunction(element, state, scrollX, scrollY))
-                {
+            if(!HasCapability(element, ON_SCROLL))
+                element = element->scrollHandler;
+            while(element) {
+                if(eventHandlers[element->extension].onScroll(element, state, scrollX, scrollY))
                     break;
-                }
-                element = element->parent;
+                element = element->scrollHandler;
             }
         }
     }
 
     void MouseUp(lua_State* state, int x, int y)
     {
+        MarkFrameDirty();
         mouseDown = false;
         Widget* widget = nullptr;
         int32_t* downWidgetPtr = nullptr;
@@ -1343,35 +2371,23 @@ namespace GUI
         } 
 
         if(downWidgetPtr && *downWidgetPtr != -1) {
-            Element* parent = widget->parent;
-            if(sendClickEvent && extensions[widget->extension].onClickFunction) {
-                extensions[widget->extension].onClickFunction(widget, state, x, y);
-            }
-            if(widget->bounds.Contains(x, y)) {
-                if(extensions[widget->extension].onReleaseInsideFunction) {
-                    if(extensions[widget->extension].onReleaseInsideFunction(widget, state, x, y)) {
-                        while(parent) {
-                            if(extensions[parent->extension].onChildReleasedFunction
-                                 && extensions[parent->extension].onChildReleasedFunction(parent, state, widget, x, y))
-                            {
-                                break;
-                            }
-                            parent = parent->parent;
-                        }
-                    }
-                }
-            } else {
-                if(extensions[widget->extension].onReleaseOutsideFunction) {
-                    if(extensions[widget->extension].onReleaseOutsideFunction(widget, state, x, y)) {
-                        while(parent) {
-                            if(extensions[parent->extension].onChildReleasedFunction
-                                && extensions[parent->extension].onChildReleasedFunction(parent, state, widget, x, y))
-                            {
-                                break;
-                            }
-                            parent = parent->parent;
-                        }
-                    }
+            const EventHandlers& handlers = eventHandlers[widget->extension];
+            if(sendClickEvent && HasCapability(widget, ON_CLICK)) {
+                handlers.onClick(widget, state, x, y);
+            }
+
+            bool bubble;
+            if(widget->bounds.Contains(x, y))
+                bubble = HasCapability(widget, ON_RELEASE_INSIDE) && handlers.onReleaseInside(widget, state, x, y);
+            else
+                bubble = HasCapability(widget, ON_RELEASE_OUTSIDE) && handlers.onReleaseOutside(widget, state, x, y);
+
+            if(bubble) {
+                Element* parent = widget->childReleasedHandler;
+                while(parent) {
+                    if(eventHandlers[parent->extension].onChildReleased(parent, state, widget, x, y))
+                        break;
+                    parent = parent->childReleasedHandler;
                 }
             }
             if(!sendClickEvent)
@@ -1383,87 +2399,870 @@ namespace GUI
         popupOpened = false;
     }
 
-    void UpdateWidgets(lua_State* state, int32_t x, int32_t y, Widget* widgets, int32_t widgetCount, int32_t* hoveredWidget, int32_t* widgetMask)
+    // Whether any widget that would win over widget in WidgetAt with
+    // useLayers overlaps it. If not, widget is the hit anywhere inside it.
+    // Only accurate on screen, the grid has to be built
+    bool Obstructed(int32_t widget, const int32_t* mask)
     {
-        int32_t layer = 0;
-        int32_t newHoveredWidget = -1;
+        struct CacheEntry
+        {
+            uint64_t generation;
+            int64_t mask;
+            bool obstructed;
+        };
+        static std::vector<CacheEntry> cache;
+        if(cache.size() < widgets.size())
+            cache.resize(widgets.size(), { 0, 0, false });
+
+        int64_t maskKey = mask ? *mask : INT64_MIN;
+        CacheEntry& entry = cache[widget];
+        if(entry.generation == hitGeneration && entry.mask == maskKey)
+            return entry.obstructed;
+
+        const float minX = hitFields.minX[widget];
+        const float minY = hitFields.minY[widget];
+        const float maxX = hitFields.maxX[widget];
+        const float maxY = hitFields.maxY[widget];
+        const int32_t layer = hitFields.layer[widget];
+
+        bool obstructed = false;
+        if(minX > maxX || minY > maxY || maxX < 0.0f || maxY < 0.0f) {
+            obstructed = true;
+        } else {
+            int32_t minColumn = std::min((int32_t)std::max(minX, 0.0f) / HIT_GRID_CELL_SIZE, hitGrid.columns - 1);
+            int32_t minRow = std::min((int32_t)std::max(minY, 0.0f) / HIT_GRID_CELL_SIZE, hitGrid.rows - 1);
+            int32_t maxColumn = std::min((int32_t)maxX / HIT_GRID_CELL_SIZE, hitGrid.columns - 1);
+            int32_t maxRow = std::min((int32_t)maxY / HIT_GRID_CELL_SIZE, hitGrid.rows - 1);
+
+            for(int32_t row = minRow; row <= maxRow && !obstructed; ++row) {
+                for(int32_t column = minColumn; column <= maxColumn && !obstructed; ++column) {
+                    int32_t cell = row * hitGrid.columns + column;
+                    for(int32_t i = hitGrid.cellStart[cell]; i < hitGrid.cellStart[cell + 1]; ++i) {
+                        int32_t other = hitGrid.entries[i];
+                        if(other == widget || !hitFields.draw[other])
+                            continue;
+                        if(mask && hitFields.mask[other] != *mask)
+                            continue;
+                        if(hitFields.layer[other] < layer || (hitFields.layer[other] == layer && other < widget))
+                            continue;
+                        if(hitFields.minX[other] <= maxX && hitFields.maxX[other] >= minX
+                            && hitFields.minY[other] <= maxY && hitFields.maxY[other] >= minY)
+                        {
+                            obstructed = true;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
 
-        if(mouseOwnElement)
-            return;
+        entry = { hitGeneration, maskKey, obstructed };
+        return obstructed;
+    }
 
-        for(int32_t i = 0; i < widgetCount; ++i) {
-            Widget& widget = widgets[i];
-            if(widget.draw) {
-                if(widgetMask && widget.mask != *widgetMask)
-                    continue;
+    // Siblings of the previously hovered widget are only re-tested if there
+    // are at most this many, otherwise a full hit test is cheaper
+    const static size_t HOVER_SIBLING_LIMIT = 32;
 
-                Rect bounds = widget.bounds;
-                Rect clipRect = UnpackClipRect(widget.clipRect);
-                if(bounds.Contains(x, y) && widget.layer >= layer) {
-                    if(clipRect.Nonzero()) {
-                        if(clipRect.Contains(x, y)) {
-                            newHoveredWidget = i;
-                            layer = widget.layer;
-                        }
-                    } else {
-                        newHoveredWidget = i;
-                        layer = widget.layer;
+    // WidgetAt for UpdateWidgets. Reuses the last result if nothing changed,
+    // then tries previous and its siblings before doing a full hit test
+    int32_t HoveredWidgetAt(int32_t x, int32_t y, int32_t previous, const int32_t* mask)
+    {
+        static int32_t lastX = -1;
+        static int32_t lastY = -1;
+        static uint64_t lastGeneration = 0;
+        static int64_t lastMask = 0;
+        static int32_t lastResult = -1;
+
+        int64_t maskKey = mask ? *mask : INT64_MIN;
+        if(x == lastX && y == lastY && hitGeneration == lastGeneration && maskKey == lastMask) {
+            ++statistics.hoverReused;
+            return lastResult;
+        }
+
+        if(hitGridDirty)
+            BuildHitGrid();
+
+        HitQuery query = { (float)x, (float)y, mask, true, 0, -1 };
+        auto wins = [&](int32_t widget) {
+            return hitFields.layer[widget] >= 0 && HitsWidget(query, widget) && !Obstructed(widget, mask);
+        };
+
+        int32_t result = -1;
+        bool onScreen = x >= 0 && y >= 0 && x / HIT_GRID_CELL_SIZE < hitGrid.columns && y / HIT_GRID_CELL_SIZE < hitGrid.rows;
+        if(onScreen && previous != -1 && previous < (int32_t)widgets.size()) {
+            if(wins(previous)) {
+                result = previous;
+            } else if(widgets[previous].parent && widgets[previous].parent->children.size() <= HOVER_SIBLING_LIMIT) {
+                for(Element* sibling : widgets[previous].parent->children) {
+                    if(sibling->type != WIDGET)
+                        continue;
+
+                    int32_t index = (int32_t)((Widget*)sibling - widgets.data());
+                    if(index != previous && wins(index)) {
+                        result = index;
+                        break;
                     }
                 }
             }
         }
 
+        if(result != -1) {
+            ++statistics.hoverRetested;
+        } else {
+            result = WidgetAt(x, y, mask, true);
+            ++statistics.hoverQueries;
+        }
+
+        lastX = x;
+        lastY = y;
+        lastGeneration = hitGeneration;
+        lastMask = maskKey;
+        lastResult = result;
+        return result;
+    }
+
+    void UpdateWidgets(lua_State* state, int32_t x, int32_t y, Widget* widgets, int32_t widgetCount, int32_t* hoveredWidget, int32_t* widgetMask)
+    {
+        if(mouseOwnElement)
+            return;
+
+        int32_t newHoveredWidget = HoveredWidgetAt(x, y, *hoveredWidget, widgetMask);
+
         if(newHoveredWidget != *hoveredWidget)
         { 
+            MarkFrameDirty();
             if(*hoveredWidget != -1) {
                 Widget& oldWidget = widgets[*hoveredWidget];
-                if(oldWidget.extension != -1 && extensions[oldWidget.extension].onExitFunction)
-                    extensions[oldWidget.extension].onExitFunction(&oldWidget, state);
+                if(HasCapability(&oldWidget, ON_EXIT))
+                    eventHandlers[oldWidget.extension].onExit(&oldWidget, state);
             }
 
             *hoveredWidget = newHoveredWidget;
 
             if(newHoveredWidget != -1) {
                 Widget& widget = widgets[newHoveredWidget];
-                if(widget.extension != -1 && extensions[widget.extension].onEnterFunction)
-                    extensions[widget.extension].onEnterFunction(&widget, state);
+                if(HasCapability(&widget, ON_ENTER))
+                    eventHandlers[widget.extension].onEnter(&widget, state);
+            }
+        }
+    }
+
+    // Clips axis-aligned quads against clipRect, adjusting their UVs to match.
+    // Quads entirely outside of clipRect end up with a width or height of 0
+    void ClipQuads(Vertex* vertices, int32_t vertexCount, const Rect& clipRect)
+    {
+        const float clipMaxX = clipRect.x + clipRect.width;
+        const float clipMaxY = clipRect.y + clipRect.height;
+
+        for(int32_t i = 0; i + 3 < vertexCount; i += 4) {
+            Vertex* quad = vertices + i;
+
+            // Vertex 0 and 2 are opposite corners, see CreateQuad
+            float width = quad[2].x - quad[0].x;
+            float height = quad[2].y - quad[0].y;
+            float uPerX = width != 0.0f ? (VertexWriter::U(quad[2]) - VertexWriter::U(quad[0])) / width : 0.0f;
+            float vPerY = height != 0.0f ? (VertexWriter::V(quad[2]) - VertexWriter::V(quad[0])) / height : 0.0f;
+
+            for(int32_t j = 0; j < 4; ++j) {
+                float x = std::min(std::max((float)quad[j].x, clipRect.x), clipMaxX);
+                float y = std::min(std::max((float)quad[j].y, clipRect.y), clipMaxY);
+
+                VertexWriter::SetUV(quad[j]
+                                    , VertexWriter::U(quad[j]) + (x - quad[j].x) * uPerX
+                                    , VertexWriter::V(quad[j]) + (y - quad[j].y) * vPerY);
+                VertexWriter::SetPosition(quad[j], x, y);
             }
         }
     }
 
-    void UpdateDrawList(DrawList& drawList, Vertex* vertices, uint32_t* indicies, Widget* widgets, size_t widgetCount, int32_t layer, uint64_t clipRect, size_t* vertexOffset, size_t* indexOffset)
+    bool Overlaps(const Rect& lhs, const Rect& rhs)
     {
-        size_t vertexCount = 0;
-        size_t indexCount = 0;
+        return lhs.x < rhs.x + rhs.width && rhs.x < lhs.x + lhs.width
+                && lhs.y < rhs.y + rhs.height && rhs.y < lhs.y + lhs.height;
+    }
 
-        for(size_t i = 0; i < widgetCount; ++i) {
-            Widget& widget = widgets[i];
+    Rect Union(const Rect& lhs, const Rect& rhs)
+    {
+        if(lhs.width <= 0.0f || lhs.height <= 0.0f)
+            return rhs;
+        if(rhs.width <= 0.0f || rhs.height <= 0.0f)
+            return lhs;
+
+        float minX = std::min(lhs.x, rhs.x);
+        float minY = std::min(lhs.y, rhs.y);
+        return { minX
+                    , minY
+                    , std::max(lhs.x + lhs.width, rhs.x + rhs.width) - minX
+                    , std::max(lhs.y + lhs.height, rhs.y + rhs.height) - minY };
+    }
+
+    Rect Intersection(const Rect& lhs, const Rect& rhs)
+    {
+        float minX = std::max(lhs.x, rhs.x);
+        float minY = std::max(lhs.y, rhs.y);
+        float maxX = std::min(lhs.x + lhs.width, rhs.x + rhs.width);
+        float maxY = std::min(lhs.y + lhs.height, rhs.y + rhs.height);
+        return { minX, minY, std::max(0.0f, maxX - minX), std::max(0.0f, maxY - minY) };
+    }
+
+    // indicies is nullptr when using IndexMode::SharedQuads
+    void CopyWidget(Widget& widget, Vertex* vertices, uint32_t* indicies, uint32_t indexOffset, uint64_t clipRect)
+    {
+        std::memcpy(vertices, widget.vertices, sizeof(Vertex) * widget.vertexCount);
+
+        if(clipRect != 0)
+            ClipQuads(vertices, widget.vertexCount, UnpackClipRect(clipRect));
+
+        widget.modified = false;
+        if(!indicies)
+            return;
+
+        std::memcpy(indicies, widget.indicies, sizeof(uint32_t) * widget.indexCount);
+        if(indexOffset != 0) {
+            for(int32_t j = 0; j < widget.indexCount; ++j) {
+                indicies[j] += indexOffset;
+            }
+        }
+    }
+
+    uint16_t PackUV(float uv)
+    {
+        return (uint16_t)(std::min(std::max(uv, 0.0f), 1.0f) * 65535.0f + 0.5f);
+    }
+
+    // Converts the widget's quads to instances, clipping them the same way
+    // as ClipQuads if clipRect is nonzero
+    void CopyWidgetInstances(Widget& widget, QuadInstance* instances, uint64_t clipRect)
+    {
+        const Rect clip = UnpackClipRect(clipRect);
+
+        for(int32_t i = 0; i + 3 < widget.vertexCount; i += 4) {
+            // Vertex 0 and 2 are opposite corners, see CreateQuad
+            const Vertex& min = widget.vertices[i];
+            const Vertex& max = widget.vertices[i + 2];
+
+            float x0 = min.x;
+            float y0 = min.y;
+            float x1 = max.x;
+            float y1 = max.y;
+            float u0 = VertexWriter::U(min);
+            float v0 = VertexWriter::V(min);
+            float u1 = VertexWriter::U(max);
+            float v1 = VertexWriter::V(max);
+
+            if(clipRect != 0) {
+                float width = x1 - x0;
+                float height = y1 - y0;
+                float uPerX = width != 0.0f ? (u1 - u0) / width : 0.0f;
+                float vPerY = height != 0.0f ? (v1 - v0) / height : 0.0f;
+
+                float clippedX0 = std::min(std::max(x0, clip.x), clip.x + clip.width);
+                float clippedY0 = std::min(std::max(y0, clip.y), clip.y + clip.height);
+                float clippedX1 = std::min(std::max(x1, clip.x), clip.x + clip.width);
+                float clippedY1 = std::min(std::max(y1, clip.y), clip.y + clip.height);
+
+                u0 += (clippedX0 - x0) * uPerX;
+                v0 += (clippedY0 - y0) * vPerY;
+                u1 += (clippedX1 - x1) * uPerX;
+                v1 += (clippedY1 - y1) * vPerY;
+                x0 = clippedX0;
+                y0 = clippedY0;
+                x1 = clippedX1;
+                y1 = clippedY1;
+            }
 
-            if(widget.draw && widget.layer == layer && widget.clipRect == clipRect) { 
-                std::memcpy(vertices + vertexCount, widget.vertices, sizeof(Vertex) * widget.vertexCount);
-                std::memcpy(indicies + indexCount, widget.indicies, sizeof(uint32_t) * widget.indexCount);
+            instances[i / 4] = { x0, y0, x1 - x0, y1 - y0
+                                    , PackUV(u0), PackUV(v0), PackUV(u1), PackUV(v1)
+                                    , min.r, min.g, min.b, min.a };
+        }
+
+        widget.modified = false;
+    }
 
-                for(int32_t j = 0; j < widget.indexCount; ++j) {
-                    indicies[indexCount + j] += vertexCount + *vertexOffset;
-                } 
-                widget.modified = false;
+    // Same as UpdateDrawList, but for DrawListFormat::QuadInstances.
+    // firstInstance is the number of instances in all draw lists before this one
+    void UpdateDrawListInstances(DrawList& drawList, AssembledDrawList& assembled, std::vector<AssembledWidget>& current, size_t firstInstance)
+    {
+        int32_t vertexCount = current.empty() ? 0 : current.back().vertexOffset + current.back().vertexCount;
 
-                vertexCount += widget.vertexCount;
-                indexCount += widget.indexCount;
+        if(current == assembled.widgets && !assembled.stale) {
+            for(const AssembledWidget& entry : assembled.widgets) {
+                Widget& widget = widgets[entry.widget];
+                if(widget.modified)
+                    CopyWidgetInstances(widget, &assembled.instances[entry.vertexOffset / 4], entry.clipRect);
             }
+        } else {
+            assembled.instances.resize(vertexCount / 4);
+            for(const AssembledWidget& entry : current)
+                CopyWidgetInstances(widgets[entry.widget], &assembled.instances[entry.vertexOffset / 4], entry.clipRect);
+            assembled.widgets.swap(current);
+            assembled.stale = false;
         }
 
-        drawList.vertices = vertices;
+        drawList.instances = assembled.instances.data();
+        drawList.instanceCount = (int32_t)assembled.instances.size();
+        drawList.baseInstance = (int32_t)firstInstance;
+    }
+
+    // current is the widgets of the draw list, see UpdateGenerations.
+    // firstVertex is the number of vertices in all draw lists before this one
+    void UpdateDrawList(DrawList& drawList, AssembledDrawList& assembled, std::vector<AssembledWidget>& current, size_t firstVertex)
+    {
+        int32_t vertexCount = current.empty() ? 0 : current.back().vertexOffset + current.back().vertexCount;
+        int32_t indexCount = current.empty() ? 0 : current.back().indexOffset + current.back().indexCount;
+
+        const bool sharedQuads = settings.indexMode == IndexMode::SharedQuads;
+        uint32_t indexBase = settings.indexMode == IndexMode::Rebased ? (uint32_t)firstVertex : 0;
+
+        if(current == assembled.widgets && !assembled.stale) {
+            // Only the draw lists before this one changed size, so the
+            // indicies only have to be moved
+            if(indexBase != assembled.indexBase) {
+                for(uint32_t& index : assembled.indicies)
+                    index += indexBase - assembled.indexBase;
+                assembled.indexBase = indexBase;
+            }
+
+            for(const AssembledWidget& entry : assembled.widgets) {
+                Widget& widget = widgets[entry.widget];
+                if(widget.modified)
+                    CopyWidget(widget, &assembled.vertices[entry.vertexOffset], sharedQuads ? nullptr : &assembled.indicies[entry.indexOffset], indexBase + entry.vertexOffset, entry.clipRect);
+            }
+        } else {
+            assembled.vertices.resize(vertexCount);
+            assembled.indicies.resize(sharedQuads ? 0 : indexCount);
+            assembled.indexBase = indexBase;
+            for(const AssembledWidget& entry : current)
+                CopyWidget(widgets[entry.widget], &assembled.vertices[entry.vertexOffset], sharedQuads ? nullptr : &assembled.indicies[entry.indexOffset], indexBase + entry.vertexOffset, entry.clipRect);
+            assembled.widgets.swap(current);
+            assembled.stale = false;
+        }
+
+        drawList.vertices = assembled.vertices.data();
         drawList.vertexCount = vertexCount;
-        drawList.indicies = indicies;
-        drawList.indexCount = indexCount;
+        drawList.baseVertex = settings.indexMode != IndexMode::Rebased ? (int32_t)firstVertex : 0;
+        if(sharedQuads) {
+            // Points to quadIndicies once all draw lists are assembled
+            drawList.indicies = nullptr;
+            drawList.indexCount = vertexCount / 4 * 6;
+        } else {
+            drawList.indicies = assembled.indicies.data();
+            drawList.indexCount = indexCount;
+        }
+    }
+
+    // Gathers the widgets of every batch group into groupWidgets, and gives
+    // each draw list that will differ from last frame a new generation.
+    // Returns whether anything changed. Has to run before the draw lists are
+    // assembled, since that clears Widget::modified
+    bool UpdateGenerations()
+    {
+        bool changed = (int32_t)assembledDrawLists.size() != batchGroupCount;
+        assembledDrawLists.resize(batchGroupCount);
+        if((int32_t)groupWidgets.size() < batchGroupCount)
+            groupWidgets.resize(batchGroupCount);
+
+        const bool rebased = settings.format == DrawListFormat::Vertices && settings.indexMode == IndexMode::Rebased;
+        uint32_t firstVertex = 0;
+        for(int32_t i = 0; i < batchGroupCount; ++i) {
+            const BatchGroup& group = batchGroups[i];
+            std::vector<AssembledWidget>& current = groupWidgets[i];
+            current.resize(0);
+
+            // A widget outgrowing its slot moves the arena around
+            bool modified = settings.vertexArena && arenaDirty;
+            int32_t vertexCount = 0;
+            int32_t indexCount = 0;
+            for(int32_t batchIndex : group.batches) {
+                const Batch& batch = batches[batchIndex];
+                uint64_t cpuClipRect = group.mixedClipRects ? batch.clipRect : 0;
+
+                for(int32_t widgetIndex : batch.widgets) {
+                    const Widget& widget = widgets[widgetIndex];
+                    current.push_back({ widgetIndex, widget.vertexCount, widget.indexCount, vertexCount, indexCount, cpuClipRect });
+                    modified = modified || widget.modified;
+
+                    vertexCount += widget.vertexCount;
+                    indexCount += widget.indexCount;
+                }
+            }
+
+            // Rebased indicies depend on where the draw list starts
+            AssembledDrawList& assembled = assembledDrawLists[i];
+            uint64_t clipRect = group.mixedClipRects ? 0 : group.clipRect;
+            if(modified
+                || current != assembled.widgets
+                || clipRect != assembled.clipRect
+                || (rebased && firstVertex != assembled.indexBase))
+            {
+                assembled.generation = ++generationCounter;
+                assembled.clipRect = clipRect;
+                changed = true;
+            }
+
+            firstVertex += vertexCount;
+        }
+
+        if(changed)
+            ++frameGeneration;
+        return changed;
+    }
+
+    uint64_t GetFrameGeneration()
+    {
+        return frameGeneration;
+    }
+
+    // Lays out the arena in draw order if the drawn widgets or their slots
+    // changed, then points every draw list at its range of the arena
+    void LayoutArena()
+    {
+        static std::vector<int32_t> order;
+        order.resize(0);
+        for(int32_t i = 0; i < batchGroupCount; ++i) {
+            for(int32_t batchIndex : batchGroups[i].batches) {
+                for(int32_t widgetIndex : batches[batchIndex].widgets)
+                    order.push_back(widgetIndex);
+            }
+        }
+
+        arenaSlots.resize(widgets.size(), { -1, 0, 0 });
+
+        if(arenaDirty || order != arenaOrder) {
+            // Drawn widgets first, followed by everything else with a slot
+            static std::vector<Vertex> compacted;
+            static std::vector<bool> placed;
+            compacted.resize(0);
+            placed.assign(widgets.size(), false);
+
+            auto place = [](int32_t widgetIndex) {
+                ArenaSlot& slot = arenaSlots[widgetIndex];
+                int32_t offset = (int32_t)compacted.size();
+                if(slot.offset != -1)
+                    compacted.insert(compacted.end(), arena.begin() + slot.offset, arena.begin() + slot.offset + slot.capacity);
+                slot.offset = offset;
+                placed[widgetIndex] = true;
+            };
+
+            for(int32_t widgetIndex : order)
+                place(widgetIndex);
+            for(int32_t i = 0; i < (int32_t)widgets.size(); ++i) {
+                if(!placed[i] && arenaSlots[i].offset != -1)
+                    place(i);
+            }
+
+            arena.swap(compacted);
+            PointWidgetsToArena();
+            arenaOrder.swap(order);
+            arenaDirty = false;
+        }
+
+        for(int32_t i = 0, widgetOffset = 0; i < batchGroupCount; ++i) {
+            DrawList& drawList = drawLists[i];
+            memset(&drawList, 0, sizeof(DrawList));
+
+            int32_t firstVertex = -1;
+            int32_t vertexCount = 0;
+            for(int32_t batchIndex : batchGroups[i].batches) {
+                for(size_t j = 0; j < batches[batchIndex].widgets.size(); ++j, ++widgetOffset) {
+                    int32_t widgetIndex = arenaOrder[widgetOffset];
+                    Widget& widget = widgets[widgetIndex];
+                    ArenaSlot& slot = arenaSlots[widgetIndex];
+
+                    // Widgets may use less than they allocated
+                    if(widget.vertexCount != slot.vertexCount) {
+                        if(widget.vertexCount < slot.capacity)
+                            memset(arena.data() + slot.offset + widget.vertexCount, 0, sizeof(Vertex) * (slot.capacity - widget.vertexCount));
+                        slot.vertexCount = widget.vertexCount;
+                    }
+                    widget.modified = false;
+
+                    if(firstVertex == -1)
+                        firstVertex = slot.offset;
+                    vertexCount += slot.capacity;
+                }
+            }
+
+            assembledDrawLists[i].widgets.swap(groupWidgets[i]);
+
+            drawList.vertices = arena.data() + std::max(firstVertex, 0);
+            drawList.vertexCount = vertexCount;
+            drawList.indexCount = vertexCount / 4 * 6;
+            drawList.baseVertex = std::max(firstVertex, 0);
+            drawList.clipRect = UnpackClipRect(batchGroups[i].clipRect);
+        }
+    }
+
+    bool MapSink(OutputSink& sink)
+    {
+        if(sink.map && !sink.map(&sink)) {
+            sink.overflowed = true;
+            return false;
+        }
+        return true;
+    }
+
+    // Copies the laid out arena to the sink in one go
+    bool CopyArenaToSink(OutputSink& sink)
+    {
+        if(!MapSink(sink))
+            return false;
+
+        int32_t vertexCount = 0;
+        for(int32_t i = 0; i < batchGroupCount; ++i)
+            vertexCount += drawLists[i].vertexCount;
+
+        if(vertexCount > sink.vertexCapacity) {
+            sink.overflowed = true;
+            return false;
+        }
+
+        std::memcpy(sink.vertices, arena.data(), sizeof(Vertex) * vertexCount);
+        for(int32_t i = 0; i < batchGroupCount; ++i)
+            drawLists[i].vertices = sink.vertices + drawLists[i].baseVertex;
+        sink.vertexCount = vertexCount;
+        return true;
+    }
+
+    // Assembles every draw list straight into the sink instead of the
+    // retained draw lists, copying all widgets. Nothing is written if the
+    // sink is too small
+    bool WriteToSink(OutputSink& sink)
+    {
+        if(!MapSink(sink))
+            return false;
+
+        const bool instanced = settings.format == DrawListFormat::QuadInstances;
+        const bool sharedQuads = settings.indexMode == IndexMode::SharedQuads;
+
+        bool fits;
+        if(instanced)
+            fits = drawnVertexCount / 4 <= sink.instanceCapacity;
+        else
+            fits = drawnVertexCount <= sink.vertexCapacity && (sharedQuads || drawnIndexCount <= sink.indexCapacity);
+        if(!fits) {
+            sink.overflowed = true;
+            return false;
+        }
+
+        int32_t vertexCount = 0;
+        int32_t indexCount = 0;
+        for(int32_t i = 0; i < batchGroupCount; ++i) {
+            const BatchGroup& group = batchGroups[i];
+            const int32_t firstVertex = vertexCount;
+            const int32_t firstIndex = indexCount;
+
+            for(int32_t batchIndex : group.batches) {
+                uint64_t cpuClipRect = group.mixedClipRects ? batches[batchIndex].clipRect : 0;
+
+                for(int32_t widgetIndex : batches[batchIndex].widgets) {
+                    Widget& widget = widgets[widgetIndex];
+                    if(instanced) {
+                        CopyWidgetInstances(widget, sink.instances + vertexCount / 4, cpuClipRect);
+                    } else {
+                        uint32_t indexOffset = settings.indexMode == IndexMode::Rebased ? vertexCount : vertexCount - firstVertex;
+                        CopyWidget(widget, sink.vertices + vertexCount, sharedQuads ? nullptr : sink.indicies + indexCount, indexOffset, cpuClipRect);
+                    }
+                    vertexCount += widget.vertexCount;
+                    indexCount += widget.indexCount;
+                }
+            }
+
+            DrawList& drawList = drawLists[i];
+            memset(&drawList, 0, sizeof(DrawList));
+            drawList.clipRect = UnpackClipRect(group.mixedClipRects ? 0 : group.clipRect);
+            if(instanced) {
+                drawList.instances = sink.instances + firstVertex / 4;
+                drawList.instanceCount = (vertexCount - firstVertex) / 4;
+                drawList.baseInstance = firstVertex / 4;
+            } else {
+                drawList.vertices = sink.vertices + firstVertex;
+                drawList.vertexCount = vertexCount - firstVertex;
+                drawList.baseVertex = settings.indexMode != IndexMode::Rebased ? firstVertex : 0;
+                if(sharedQuads) {
+                    drawList.indexCount = drawList.vertexCount / 4 * 6;
+                } else {
+                    drawList.indicies = sink.indicies + firstIndex;
+                    drawList.indexCount = indexCount - firstIndex;
+                }
+            }
+        }
+
+        sink.vertexCount = instanced ? 0 : vertexCount;
+        sink.indexCount = instanced || sharedQuads ? 0 : indexCount;
+        sink.instanceCount = instanced ? vertexCount / 4 : 0;
+
+        // The retained draw lists missed any modifications copied here
+        for(int32_t i = 0, firstVertex = 0; i < batchGroupCount; ++i) {
+            AssembledDrawList& assembled = assembledDrawLists[i];
+            assembled.widgets.swap(groupWidgets[i]);
+            assembled.indexBase = settings.indexMode == IndexMode::Rebased ? firstVertex : 0;
+            assembled.stale = true;
+            firstVertex += drawLists[i].vertexCount;
+        }
+
+        return true;
+    }
+
+    // Bounds of the vertices a widget emits, which may reach outside of
+    // Widget::bounds, such as overflowing text
+    Rect VertexBounds(const Widget& widget)
+    {
+        if(widget.vertexCount == 0)
+            return { 0.0f, 0.0f, 0.0f, 0.0f };
+
+        float minX = widget.vertices[0].x;
+        float minY = widget.vertices[0].y;
+        float maxX = minX;
+        float maxY = minY;
+        for(int32_t i = 1; i < widget.vertexCount; ++i) {
+            minX = std::min(minX, (float)widget.vertices[i].x);
+            minY = std::min(minY, (float)widget.vertices[i].y);
+            maxX = std::max(maxX, (float)widget.vertices[i].x);
+            maxY = std::max(maxY, (float)widget.vertices[i].y);
+        }
+        return { minX, minY, maxX - minX, maxY - minY };
+    }
+
+    // Updates widgetExtents for every modified widget. The batches have to be
+    // rebuilt if what a drawn widget covers or its vertex count changed
+    void UpdateWidgetExtents()
+    {
+        if(widgetExtents.size() != widgets.size()) {
+            widgetExtents.assign(widgets.size(), { { 0.0f, 0.0f, 0.0f, 0.0f }, -1, -1 });
+            batchesDirty = true;
+        }
+
+        for(int32_t i = 0; i < (int32_t)widgets.size(); ++i) {
+            const Widget& widget = widgets[i];
+            WidgetExtent& extent = widgetExtents[i];
+            if(!widget.modified && widget.vertexCount == extent.vertexCount && widget.indexCount == extent.indexCount)
+                continue;
+
+            Rect bounds = VertexBounds(widget);
+            if(widget.draw
+                && (widget.vertexCount != extent.vertexCount
+                    || widget.indexCount != extent.indexCount
+                    || bounds.x != extent.vertexBounds.x
+                    || bounds.y != extent.vertexBounds.y
+                    || bounds.width != extent.vertexBounds.width
+                    || bounds.height != extent.vertexBounds.height))
+            {
+                batchesDirty = true;
+            }
+            extent = { bounds, widget.vertexCount, widget.indexCount };
+        }
+    }
+
+    // Sorts all drawn widgets into batches by layer and clip rect in a single
+    // pass. Batches are ordered by layer, and by the first widget in them
+    // within a layer
+    void BuildBatches()
+    {
+        drawnVertexCount = 0;
+        drawnIndexCount = 0;
+        for(Batch& batch : batches)
+            batch.widgets.resize(0);
+        batchOrder.resize(0);
+        batchLookup.clear();
+
+        for(int32_t i = 0; i < (int32_t)widgets.size(); ++i) {
+            const Widget& widget = widgets[i];
+            if(!widget.draw)
+                continue;
+
+            auto iter = batchLookup.find({ widget.layer, widget.clipRect });
+            int32_t batchIndex;
+            if(iter == batchLookup.end()) {
+                batchIndex = (int32_t)batchOrder.size();
+                if(batchIndex == (int32_t)batches.size())
+                    batches.emplace_back();
+                batches[batchIndex].layer = widget.layer;
+                batches[batchIndex].clipRect = widget.clipRect;
+                batches[batchIndex].bounds = { 0.0f, 0.0f, 0.0f, 0.0f };
+                batches[batchIndex].quadsOnly = true;
+                batchLookup.insert(std::make_pair(BatchKey{ widget.layer, widget.clipRect }, batchIndex));
+                batchOrder.push_back(batchIndex);
+            } else {
+                batchIndex = iter->second;
+            }
+            Batch& batch = batches[batchIndex];
+            batch.widgets.push_back(i);
+            const Rect& bounds = widgetExtents[i].vertexBounds;
+            batch.bounds = Union(batch.bounds, widget.clipRect != 0 ? Intersection(bounds, UnpackClipRect(widget.clipRect)) : bounds);
+            drawnVertexCount += widget.vertexCount;
+            drawnIndexCount += widget.indexCount;
+            batch.quadsOnly = batch.quadsOnly && widget.vertexCount % 4 == 0;
+        }
 
-        *vertexOffset += vertexCount;
-        *indexOffset += indexCount;
+        // Batches are created in order of their first widget, so a stable sort
+        // by layer is enough
+        std::stable_sort(batchOrder.begin(), batchOrder.end(), [](int32_t lhs, int32_t rhs) {
+            return batches[lhs].layer < batches[rhs].layer;
+        });
     }
 
-    void UpdateGUI(lua_State* state, int32_t x, int32_t y)
+    // Merges batches into groups that can be drawn with a single draw list.
+    // Each batch is added to the latest group it can join. A batch may skip
+    // past groups it cannot join, as long as it doesn't overlap them, since
+    // this changes the order it is drawn in
+    void MergeBatches()
     {
+        batchGroupCount = 0;
+
+        for(int32_t batchIndex : batchOrder) {
+            const Batch& batch = batches[batchIndex];
+            // Arena draw lists can't be clipped on the CPU, since they are
+            // not copies, so only batches with the same clip rect are merged
+            const bool sameClipRect = settings.vertexArena;
+            bool mergeable = mergeBatches && (sameClipRect || batch.quadsOnly || batch.clipRect == 0);
+
+            int32_t target = -1;
+            if(mergeable) {
+                for(int32_t i = batchGroupCount - 1; i >= 0; --i) {
+                    if(batchGroups[i].mergeable && (!sameClipRect || batchGroups[i].clipRect == batch.clipRect)) {
+                        target = i;
+                        break;
+                    }
+                    if(Overlaps(batchGroups[i].bounds, batch.bounds))
+                        break;
+                }
+            }
+
+            if(target == -1) {
+                target = batchGroupCount++;
+                if(target == (int32_t)batchGroups.size())
+                    batchGroups.emplace_back();
+
+                BatchGroup& group = batchGroups[target];
+                group.batches.resize(0);
+                group.clipRect = batch.clipRect;
+                group.mixedClipRects = false;
+                group.mergeable = mergeable;
+                group.bounds = batch.bounds;
+            }
+
+            BatchGroup& group = batchGroups[target];
+            group.batches.push_back(batchIndex);
+            group.bounds = Union(group.bounds, batch.bounds);
+            if(group.clipRect != batch.clipRect)
+                group.mixedClipRects = true;
+        }
+
+        statistics.batchCount = (int32_t)batchOrder.size();
+        statistics.drawListCount = batchGroupCount;
+        statistics.mergedBatches = statistics.batchCount - statistics.drawListCount;
+    }
+
+    const Statistics& GetStatistics()
+    {
+        return statistics;
+    }
+
+    void SetBatchMerging(bool merge)
+    {
+        MarkBatchesDirty();
+        mergeBatches = merge;
+    }
+
+    // Single producer, single consumer ring written by PushInput and read by
+    // UpdateGUI. head and tail only ever increase and wrap around
+    const static uint32_t INPUT_QUEUE_SIZE = 256; // Must be a power of two
+    static InputEvent inputQueue[INPUT_QUEUE_SIZE];
+    static std::atomic<uint32_t> inputQueueHead(0);
+    static std::atomic<uint32_t> inputQueueTail(0);
+    static uint64_t lastInputTimestamp = 0;
+
+    bool PushInput(const InputEvent& event)
+    {
+        uint32_t tail = inputQueueTail.load(std::memory_order_relaxed);
+        if(tail - inputQueueHead.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE)
+            return false;
+
+        inputQueue[tail & (INPUT_QUEUE_SIZE - 1)] = event;
+        inputQueueTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    uint64_t GetLastInputTimestamp()
+    {
+        return lastInputTimestamp;
+    }
+
+    // Handles every queued event. If there were any, x and y are set to the
+    // position of the last one
+    void HandleInput(lua_State* state, int32_t& x, int32_t& y)
+    {
+        static std::vector<InputEvent> events;
+        events.clear();
+
+        uint32_t head = inputQueueHead.load(std::memory_order_relaxed);
+        uint32_t tail = inputQueueTail.load(std::memory_order_acquire);
+        for(; head != tail; ++head) {
+            const InputEvent& event = inputQueue[head & (INPUT_QUEUE_SIZE - 1)];
+            if(!events.empty()) {
+                InputEvent& previous = events.back();
+                if(event.type == InputEventType::MouseMove && previous.type == InputEventType::MouseMove) {
+                    previous = event;
+                    continue;
+                }
+                if(event.type == InputEventType::Scroll && previous.type == InputEventType::Scroll
+                    && event.x == previous.x && event.y == previous.y)
+                {
+                    previous.scrollX += event.scrollX;
+                    previous.scrollY += event.scrollY;
+                    previous.timestamp = event.timestamp;
+                    continue;
+                }
+            }
+            events.push_back(event);
+        }
+        inputQueueHead.store(head, std::memory_order_release);
+
+        if(events.empty())
+            return;
+
+        for(const InputEvent& event : events) {
+            switch(event.type) {
+                case InputEventType::MouseMove:
+                    break;
+                case InputEventType::MouseDown:
+                    MouseDown(state, event.x, event.y);
+                    break;
+                case InputEventType::MouseUp:
+                    MouseUp(state, event.x, event.y);
+                    break;
+                case InputEventType::Scroll:
+                    if(event.scrollX != 0 || event.scrollY != 0)
+                        Scroll(state, event.x, event.y, event.scrollX, event.scrollY);
+                    break;
+            }
+        }
+
+        x = events.back().x;
+        y = events.back().y;
+        lastInputTimestamp = events.back().timestamp;
+    }
+
+    // Frame generation when UpdateGUI last returned
+    static uint64_t reportedFrameGeneration = 0;
+    // Number of popups when hovering was last updated. Popups opened or
+    // closed after that need another update to hover the right widget
+    static size_t hoveredPopupCount = 0;
+
+    UpdateStatus UpdateGUI(lua_State* state, int32_t x, int32_t y, OutputSink* sink/*= nullptr*/)
+    {
+        HandleInput(state, x, y);
+
+        if(sink) {
+            sink->vertexCount = 0;
+            sink->indexCount = 0;
+            sink->instanceCount = 0;
+            sink->overflowed = false;
+            sink->unchanged = false;
+        }
+
         if(!widgets.empty()) {
             if(!popups.empty()) {
                 int32_t popupsToPop = 0;
@@ -1475,24 +3274,7 @@ namespace GUI
                     }
 
                     if(popup.closeOn == HOVER) {
-                        bool found = false;
-                        for(int32_t j = 0; j < (int32_t)widgets.size(); ++j) {
-                            Widget* widget = &widgets[j];
-                            if(widget->mask != popup.widgetMask)
-                                continue;
-                            if(widget->draw && widget->bounds.Contains(x, y)) { // TODO: check only widgets here and in other places
-                                Rect clipRect = UnpackClipRect(widget->clipRect);
-                                if(clipRect.Nonzero()) {
-                                    if(clipRect.Contains(x, y)) {
-                                        found = true;
-                                        break;
-                                    }
-                                } else {
-                                    found = true;
-                                    break;
-                                }
-                            }
-                        }
+                        bool found = WidgetAt(x, y, &popup.widgetMask, false) != -1;
 
                         if(!found) {
                             if(widgets[popup.parent].bounds.Contains(x, y)) {
@@ -1520,94 +3302,100 @@ namespace GUI
                 widgetMask = &popups.back().widgetMask;
 
             UpdateWidgets(state, x, y, widgets.data(), widgets.size(), hoveredWidgetPtr, widgetMask);
-
-            for(size_t i = 0; i < widgets.size(); ++i) {
-                if(widgets[i].update && extensions[widgets[i].extension].onUpdateFunction) {
-                    extensions[widgets[i].extension].onUpdateFunction(&widgets[i], state, x, y);
-                    Element* parent = widgets[i].parent;
-                    while(parent)
-                    {
-                        if(extensions[parent->extension].onChildUpdateFunction
-                            && extensions[parent->extension].onChildUpdateFunction(parent, state, &widgets[i], x, y))
-                        {
+            hoveredPopupCount = popups.size();
+
+            // Copied since updates may change which widgets are updating
+            static std::vector<int32_t> updating;
+            updating = updatingWidgets;
+            if(!updating.empty())
+                MarkFrameDirty();
+            for(int32_t i : updating) {
+                if(HasCapability(&widgets[i], ON_UPDATE)) {
+                    eventHandlers[widgets[i].extension].onUpdate(&widgets[i], state, x, y);
+                    Element* parent = widgets[i].childUpdateHandler;
+                    while(parent) {
+                        if(eventHandlers[parent->extension].onChildUpdate(parent, state, &widgets[i], x, y))
                             break;
-                        }
-                        parent = parent->parent;
+                        parent = parent->childUpdateHandler;
                     }
                 }
             }
 
-            int vertexCount = 0;
-            int indexCount = 0;
-            for(size_t i = 0; i < widgets.size(); ++i) {
-                if(widgets[i].draw) {
-                    vertexCount += widgets[i].vertexCount;
-                    indexCount += widgets[i].indexCount;
+            // Nothing can have changed without frameDirty being set, so
+            // the draw lists from last frame are still valid. They only have
+            // to be assembled if the host wants them in a sink that doesn't
+            // have them yet
+            if(!frameDirty && (!sink || sink->generation == frameGeneration)) {
+                if(sink)
+                    sink->unchanged = true;
+            } else {
+                UpdateWidgetExtents();
+                if(batchesDirty) {
+                    BuildBatches();
+                    MergeBatches();
+                    batchesDirty = false;
+                }
+                frameDirty = false;
+
+                bool changed = UpdateGenerations();
+
+                drawLists.resize(batchGroupCount);
+                size_t vertexOffset = 0;
+                size_t instanceOffset = 0;
+                bool assembled = false;
+                if(sink && !changed && sink->generation == frameGeneration) {
+                    // The host already has this frame, and the draw lists are
+                    // the same as last frame
+                    sink->unchanged = true;
+                    assembled = true;
+                } else if(settings.vertexArena) {
+                    LayoutArena();
+                    if(sink)
+                        CopyArenaToSink(*sink);
+                    assembled = true;
+                } else if(sink) {
+                    assembled = WriteToSink(*sink);
                 }
-            }
-            if((int)vertices.size() != vertexCount) {
-                vertices.resize(vertexCount);
-            }
-            if((int)indicies.size() != indexCount) {
-                indicies.resize(indexCount);
-            }
-
-            const static int MAX_CLIP_RECTS = 64; // Max of 64 unique clip rects for now
-            struct LayerClipRect
-            {
-                int32_t layer;
-                uint64_t clipRect;
-            };
-            int layerClipRectCount = 0;
-            LayerClipRect layerClipRect[MAX_CLIP_RECTS];
-
-            int32_t layer = 0;
-            int32_t nextLayer = 0;
-            bool loop = true;
-            while(loop) {
-                for(size_t i = 0; i < widgets.size(); ++i) {
-                    if(widgets[i].layer == layer) {
-                        if(layerClipRectCount == 0) {
-                            layerClipRect[layerClipRectCount].layer = widgets[i].layer;
-                            layerClipRect[layerClipRectCount++].clipRect = widgets[i].clipRect;
-                        } else {
-                            bool found = false;
-                            for(int j = 0; j < layerClipRectCount; ++j) {
-                                if(layerClipRect[j].layer == widgets[i].layer
-                                    && layerClipRect[j].clipRect == widgets[i].clipRect)
-                                {
-                                    found = true;
-                                    break;
-                                }
-                            }
 
-                            if(!found) {
-                                layerClipRect[layerClipRectCount++] = { widgets[i].layer, widgets[i].clipRect };
-                            }
-                        }
-                    } else {
-                        if(widgets[i].layer > layer) {
-                            if(nextLayer == layer)
-                                nextLayer = widgets[i].layer;
-                            else
-                                nextLayer = std::min(nextLayer, widgets[i].layer);
-                        }
-                    }
+                for(int32_t i = 0; i < batchGroupCount && !assembled; ++i) {
+                    const BatchGroup& group = batchGroups[i];
+                    memset(drawLists.data() + i, 0, sizeof(DrawList));
+                    if(settings.format == DrawListFormat::QuadInstances)
+                        UpdateDrawListInstances(drawLists[i], assembledDrawLists[i], groupWidgets[i], instanceOffset);
+                    else
+                        UpdateDrawList(drawLists[i], assembledDrawLists[i], groupWidgets[i], vertexOffset);
+                    drawLists[i].clipRect = UnpackClipRect(group.mixedClipRects ? 0 : group.clipRect);
+                    vertexOffset += drawLists[i].vertexCount;
+                    instanceOffset += drawLists[i].instanceCount;
                 }
 
-                if(layer == nextLayer)
-                    loop = false;
-                layer = nextLayer;
-            }
+                if(settings.format == DrawListFormat::Vertices && settings.indexMode == IndexMode::SharedQuads) {
+                    int32_t maxIndexCount = 0;
+                    for(const DrawList& drawList : drawLists)
+                        maxIndexCount = std::max(maxIndexCount, drawList.indexCount);
+                    ReserveQuadIndicies(maxIndexCount / 6);
+                    for(DrawList& drawList : drawLists)
+                        drawList.indicies = quadIndicies.data();
+                }
 
-            drawLists.resize(layerClipRectCount);
-            size_t vertexOffset = 0;
-            size_t indexOffset = 0;
-            for(int i = 0; i < layerClipRectCount; ++i) {
-                memset(drawLists.data() + i, 0, sizeof(DrawList));
-                UpdateDrawList(drawLists[i], vertices.data() + vertexOffset, indicies.data() + indexOffset, widgets.data(), widgets.size(), layerClipRect[i].layer, layerClipRect[i].clipRect, &vertexOffset, &indexOffset);
-                drawLists[i].clipRect = UnpackClipRect(layerClipRect[i].clipRect);
+                for(int32_t i = 0; i < batchGroupCount; ++i)
+                    drawLists[i].generation = assembledDrawLists[i].generation;
             }
         }
+
+        if(sink)
+            sink->generation = frameGeneration;
+
+        UpdateStatus status;
+        status.redraw = frameGeneration != reportedFrameGeneration;
+        reportedFrameGeneration = frameGeneration;
+
+        bool inputQueued = inputQueueTail.load(std::memory_order_acquire) != inputQueueHead.load(std::memory_order_relaxed);
+        if(!updatingWidgets.empty() || mouseOwnElement || inputQueued || popups.size() != hoveredPopupCount)
+            status.nextUpdate = 0;
+        else
+            status.nextUpdate = -1;
+
+        return status;
     }
 }
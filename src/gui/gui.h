@@ -21,6 +21,22 @@ namespace GUI
         int8_t xAdvance;
     };
 
+    // UVs are normalized to 0-65535
+    struct QuadInstance {
+        float x;
+        float y;
+        float width;
+        float height;
+        uint16_t u0;
+        uint16_t v0;
+        uint16_t u1;
+        uint16_t v1;
+        uint8_t r;
+        uint8_t g;
+        uint8_t b;
+        uint8_t a;
+    };
+
     struct DrawList {
         Vertex* vertices;
         int32_t vertexCount;
@@ -28,15 +44,103 @@ namespace GUI
         int32_t indexCount;
         int32_t textureIndex;
         Rect clipRect;
+        int32_t baseVertex; // Vertices in all previous draw lists
+        // Only used by DrawListFormat::QuadInstances
+        QuadInstance* instances;
+        int32_t instanceCount;
+        int32_t baseInstance;
+        uint64_t generation; // Equal generations mean equal contents
+    };
+
+    enum class IndexMode {
+        Rebased // Indicies index one buffer holding every draw list
+        , BaseVertex // Indicies start from 0 in each draw list
+        , SharedQuads // Quads only, every draw list uses GetQuadIndicies
+    };
+
+    enum class DrawListFormat {
+        Vertices
+        , QuadInstances // Widgets made of anything but quads are not supported
+    };
+
+    struct Settings {
+        IndexMode indexMode;
+        DrawListFormat format;
+        // Requires DrawListFormat::Vertices and IndexMode::SharedQuads
+        bool vertexArena;
+
+        Settings()
+            : indexMode(IndexMode::Rebased)
+            , format(DrawListFormat::Vertices)
+            , vertexArena(false)
+        {}
+    };
+
+    // Host memory UpdateGUI writes the draw lists into, such as a mapped buffer
+    struct OutputSink {
+        Vertex* vertices;
+        int32_t vertexCapacity;
+        uint32_t* indicies; // Not used by IndexMode::SharedQuads
+        int32_t indexCapacity;
+        QuadInstance* instances;
+        int32_t instanceCapacity;
+
+        uint64_t generation; // Nothing is written if it is the current frame
+        // Optional, called before anything is written so the memory above only
+        // has to be mapped on frames that change. Returning false counts as overflow
+        bool (*map)(OutputSink* sink);
+
+        // Set by UpdateGUI
+        int32_t vertexCount;
+        int32_t indexCount;
+        int32_t instanceCount;
+        bool overflowed;
+        bool unchanged;
+    };
+
+    enum class InputEventType {
+        MouseMove
+        , MouseDown
+        , MouseUp
+        , Scroll
+    };
+
+    struct InputEvent {
+        InputEventType type;
+        uint64_t timestamp; // In any unit the host likes
+        int32_t x;
+        int32_t y;
+        int32_t scrollX;
+        int32_t scrollY;
     };
 
-    void InitGUI(size_t resolutionX, size_t resolutionY);
+    struct UpdateStatus {
+        bool redraw;
+        // Milliseconds until the next UpdateGUI, -1 to wait for input or a reload
+        int32_t nextUpdate;
+    };
+
+    struct Statistics {
+        int32_t batchCount; // Unique layer and clip rect combinations
+        int32_t drawListCount;
+        int32_t mergedBatches;
+        int32_t hoverReused;
+        int32_t hoverRetested;
+        int32_t hoverQueries;
+        // Measure calls during the last BuildGUI
+        int32_t measureHits;
+        int32_t measureMisses;
+    };
+
+    void InitGUI(size_t resolutionX, size_t resolutionY, const Settings& settings = Settings());
     void BuildGUI(lua_State* state, const char* path);
     void ReloadGUI(lua_State* state);
+    // Readable when ReloadGUI has something to reload, or -1
+    int GetReloadHandle();
     void DestroyGUI(lua_State* state, bool keepExtensions = false);
     void ResolutionChanged(lua_State* state, int32_t width, int32_t height);
 
-    void UpdateGUI(lua_State* state, int32_t x, int32_t y);
+    UpdateStatus UpdateGUI(lua_State* state, int32_t x, int32_t y, OutputSink* sink = nullptr);
     
     void RegisterSharedLibrary(const char* name, const char* path);
 
@@ -44,12 +148,23 @@ namespace GUI
     void MouseUp(lua_State* state, int32_t x, int32_t y);
     void Scroll(lua_State* state, int32_t mouseX, int32_t mouseY, int32_t scrollX, int32_t scrollY);
 
+    // May be called from one other thread. Returns false if the queue is full
+    bool PushInput(const InputEvent& event);
+    uint64_t GetLastInputTimestamp();
+
     const uint8_t* GetFontTextureData();
     int32_t GetFontTextureWidth();
     int32_t GetFontTextureHeight();
 
     int32_t GetDrawListCount();
     const DrawList* GetDrawLists();
+    uint64_t GetFrameGeneration();
+    // Enough for the largest draw list when using IndexMode::SharedQuads
+    const uint32_t* GetQuadIndicies();
+    int32_t GetQuadIndexCount();
+
+    void SetBatchMerging(bool merge);
+    const Statistics& GetStatistics();
 }
 
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <vector>
+#include <cmath>
 #include <lua5.1/lua.hpp>
 
 namespace GUI
@@ -39,7 +40,7 @@ namespace GUI
         }
     };
 
-    struct Vertex {
+    struct FloatVertex {
         float x;
         float y;
         float u;
@@ -50,6 +51,90 @@ namespace GUI
         uint8_t a;
     };
 
+    // Positions are whole pixels and UVs are normalized to 0-65535
+    struct CompactVertex {
+        int16_t x;
+        int16_t y;
+        uint16_t u;
+        uint16_t v;
+        uint8_t r;
+        uint8_t g;
+        uint8_t b;
+        uint8_t a;
+    };
+
+    // Reads and writes vertices of either format using floats.
+    // Positions can be read straight from x and y in both formats
+    template<typename T>
+    struct VertexTraits;
+
+    template<>
+    struct VertexTraits<FloatVertex>
+    {
+        static FloatVertex Create(float x, float y, float u, float v, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+        {
+            return { x, y, u, v, r, g, b, a };
+        }
+
+        static void SetPosition(FloatVertex& vertex, float x, float y)
+        {
+            vertex.x = x;
+            vertex.y = y;
+        }
+
+        static void SetUV(FloatVertex& vertex, float u, float v)
+        {
+            vertex.u = u;
+            vertex.v = v;
+        }
+
+        static float U(const FloatVertex& vertex) { return vertex.u; }
+        static float V(const FloatVertex& vertex) { return vertex.v; }
+    };
+
+    template<>
+    struct VertexTraits<CompactVertex>
+    {
+        static int16_t PackPosition(float value)
+        {
+            return (int16_t)std::floor(value + 0.5f);
+        }
+
+        static uint16_t PackUV(float value)
+        {
+            return (uint16_t)(std::fmin(std::fmax(value, 0.0f), 1.0f) * 65535.0f + 0.5f);
+        }
+
+        static CompactVertex Create(float x, float y, float u, float v, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+        {
+            return { PackPosition(x), PackPosition(y), PackUV(u), PackUV(v), r, g, b, a };
+        }
+
+        static void SetPosition(CompactVertex& vertex, float x, float y)
+        {
+            vertex.x = PackPosition(x);
+            vertex.y = PackPosition(y);
+        }
+
+        static void SetUV(CompactVertex& vertex, float u, float v)
+        {
+            vertex.u = PackUV(u);
+            vertex.v = PackUV(v);
+        }
+
+        static float U(const CompactVertex& vertex) { return vertex.u / 65535.0f; }
+        static float V(const CompactVertex& vertex) { return vertex.v / 65535.0f; }
+    };
+
+    // Defined by setting COMPACT_VERTICES in CMakeLists.txt. The core, all
+    // extensions and the renderer have to agree on the vertex format
+#ifdef COMPACT_VERTICES
+    typedef CompactVertex Vertex;
+#else
+    typedef FloatVertex Vertex;
+#endif
+    typedef VertexTraits<Vertex> VertexWriter;
+
     enum GUIObjectType {
         WIDGET
         , LAYOUT
@@ -73,6 +158,28 @@ namespace GUI
         std::vector<Element*> children; // TODO: Replace std::vector
         Element* parent;
 
+        // Widgets are parsed in tree order, so every widget in this element's
+        // subtree, including itself, is in [firstWidget, lastWidget) of the
+        // core's widget array
+        int32_t firstWidget;
+        int32_t lastWidget;
+        int32_t widgetDepth; // Number of widgets above this element
+
+        // Nearest ancestors whose extensions implement OnChildClicked,
+        // OnChildReleased, OnChildUpdate and OnScroll, or nullptr. Events
+        // bubble through these instead of through every parent
+        Element* childClickedHandler;
+        Element* childReleasedHandler;
+        Element* childUpdateHandler;
+        Element* scrollHandler;
+
+        // Bounds the element was last built with. Building a parent only
+        // rebuilds children whose bounds changed or which have buildDirty set
+        Rect builtBounds;
+        bool buildDirty; // The element's own data changed since it was built
+        bool subtreeDirty; // buildDirty is set somewhere below this element
+        Rect ownClipRect; // Last set through SetClipRect, zero if never set
+
         Element(GUIObjectType type)
             : type(type)
         {}
@@ -83,7 +190,7 @@ namespace GUI
     {
         bool modified;
         bool draw;
-        bool update;
+        bool update; // Set through InitFunctions::setUpdate
         int32_t layer;
         Vertex* vertices;
         int32_t vertexCount;
@@ -133,6 +240,11 @@ namespace GUI
     typedef void (*StealMouseCallback)(Element* element);
     typedef void (*FreeMouseCallback)(Element* element);
     typedef Element* (*GetNamedElementCallback)(const char*);
+    typedef void (*AllocQuadsCallback)(Widget*, int32_t);
+    typedef void (*SetUpdateCallback)(Widget*, bool);
+    typedef void (*TranslateCallback)(Element*, float, float);
+    typedef int32_t (*GetNameHandleCallback)(const char*);
+    typedef Element* (*GetHandleElementCallback)(int32_t);
 
     struct InitFunctions
     {
@@ -156,6 +268,13 @@ namespace GUI
         StealMouseCallback stealMouse;
         FreeMouseCallback freeMouse;
         GetNamedElementCallback getNamedElement;
+        AllocQuadsCallback allocQuads;
+        SetUpdateCallback setUpdate;
+        TranslateCallback translate;
+        // Resolves a name once into a handle that stays valid between builds,
+        // getHandleElement returns the element with that name or nullptr
+        GetNameHandleCallback getNameHandle;
+        GetHandleElementCallback getHandleElement;
     };
 }
 
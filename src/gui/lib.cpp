@@ -87,10 +87,13 @@ void CreateQuad(Vertex* vertexBuffer
                     , uint8_t b
                     , uint8_t a)
 {
-    vertexBuffer[0] = { x, y, uMin, vMax, r, g, b, a };
-    vertexBuffer[1] = { x, y + height, uMin, vMin, r, g, b, a };
-    vertexBuffer[2] = { x + width, y + height, uMax, vMin, r, g, b, a };
-    vertexBuffer[3] = { x + width, y, uMax, vMax, r, g, b, a };
+    vertexBuffer[0] = VertexWriter::Create(x, y, uMin, vMax, r, g, b, a);
+    vertexBuffer[1] = VertexWriter::Create(x, y + height, uMin, vMin, r, g, b, a);
+    vertexBuffer[2] = VertexWriter::Create(x + width, y + height, uMax, vMin, r, g, b, a);
+    vertexBuffer[3] = VertexWriter::Create(x + width, y, uMax, vMax, r, g, b, a);
+
+    if(!elementBuffer)
+        return;
 
     elementBuffer[0] = elementOffset;
     elementBuffer[1] = elementOffset + 1;
@@ -111,7 +114,7 @@ void CreateColoredQuad(GUI::Widget* widget
                         , uint8_t a)
 {
     CreateQuad(widget->vertices + widget->offsetData.vertex
-                , widget->indicies + widget->offsetData.index
+                , widget->indicies ? widget->indicies + widget->offsetData.index : nullptr
                 , widget->offsetData.vertexBegin
                 , x
                 , y
@@ -154,20 +157,20 @@ void AdjustVertices(GUI::Vertex* vertices
     switch(origin & CENTER_HORIZONTAL) {
         case LEFT:
             for(size_t i = 1; i < vertexCount; ++i) {
-                offsetX = std::min(offsetX, vertices[i].x);
+                offsetX = std::min(offsetX, (float)vertices[i].x);
             }
             break;
         case RIGHT:
             for(size_t i = 1; i < vertexCount; ++i) {
-                offsetX = std::max(offsetX, vertices[i].x);
+                offsetX = std::max(offsetX, (float)vertices[i].x);
             }
             break;
         case CENTER_HORIZONTAL:{
             float min = offsetX;
             float max = offsetX;
             for(size_t i = 1; i < vertexCount; ++i) {
-                min = std::min(min, vertices[i].x);
-                max = std::max(max, vertices[i].x);
+                min = std::min(min, (float)vertices[i].x);
+                max = std::max(max, (float)vertices[i].x);
             }
             offsetX = (max - min) * 0.5f;
             break;}
@@ -176,30 +179,29 @@ void AdjustVertices(GUI::Vertex* vertices
     switch(origin & CENTER_VERTICAL) {
         case TOP:
             for(size_t i = 1; i < vertexCount; ++i) {
-                offsetY = std::min(offsetY, vertices[i].y);
+                offsetY = std::min(offsetY, (float)vertices[i].y);
             }
             break;
         case BOTTOM:
             for(size_t i = 1; i < vertexCount; ++i) {
-                offsetY = std::max(offsetY, vertices[i].y);
+                offsetY = std::max(offsetY, (float)vertices[i].y);
             }
             break;
         case CENTER_VERTICAL: {
             float min = offsetY;
             float max = offsetY;
             for(size_t i = 1; i < vertexCount; ++i) {
-                min = std::min(min, vertices[i].y);
-                max = std::max(max, vertices[i].y);
+                min = std::min(min, (float)vertices[i].y);
+                max = std::max(max, (float)vertices[i].y);
             }
             offsetY = min + (max - min) * 0.5f;
             break;}
     }
 
     for(size_t i = 0; i < vertexCount; ++i) {
-        vertices[i].x -= offsetX;
-        vertices[i].x += posX;
-        vertices[i].y -= offsetY;
-        vertices[i].y += posY;
+        VertexWriter::SetPosition(vertices[i]
+                                    , vertices[i].x - offsetX + posX
+                                    , vertices[i].y - offsetY + posY);
     }
 }
 
@@ -236,8 +238,9 @@ void AdjustText(GUI::Vertex* vertices
     }
 
     for(size_t i = 0; i < textLength * 4; ++i) {
-        vertices[i].x += posX - offsetX;
-        vertices[i].y += posY -offsetY;
+        VertexWriter::SetPosition(vertices[i]
+                                    , vertices[i].x + posX - offsetX
+                                    , vertices[i].y + posY - offsetY);
     }
 }
 
@@ -7,12 +7,10 @@
 
 #include <cstring>
 
-#define QUAD_ALLOC(widget, count) {\
-    widget->vertexCount = (count) * 4;\
-    widget->indexCount = (count) * 6;\
-    widget->vertices = (GUI::Vertex*)functions->memalloc(sizeof(GUI::Vertex) * widget->vertexCount);\
-    widget->indicies = (uint32_t*)functions->memalloc(sizeof(uint32_t) * widget->indexCount);\
-}
+// Allocates room for count quads, replacing any previous allocation.
+// widget->indicies is nullptr if the GUI uses IndexMode::SharedQuads or
+// DrawListFormat::QuadInstances
+#define QUAD_ALLOC(widget, count) functions->allocQuads(widget, (count))
 
 inline bool streq(const char* lhs, const char* rhs)
 {
@@ -35,6 +33,7 @@ enum Origin {
 };
 
 GUI::Color ParseColor(lua_State* state);
+// elementBuffer may be nullptr, in which case only vertices are written
 void CreateQuad(GUI::Vertex* vertexBuffer
                     , uint32_t* elementBuffer
                     , int32_t elementOffset
@@ -24,6 +24,10 @@ const static int MAX_CONNECTION_TRIES = 15;
 const static int MAX_CONNECTION_TRIES = -1;
 #endif
 
+// How often the client is asked to update while idle, so that it calls
+// ReloadGUI and changed files are noticed
+const static int32_t RELOAD_POLL_INTERVAL = 250;
+
 bool Send(int socket, const char* buffer, size_t bufferSize, bool& run)
 {
     ssize_t sent = send(socket, buffer, bufferSize, 0);
@@ -101,15 +105,15 @@ int main(int argc, const char** argv)
         return -1;
     }
 
-    int32_t resolution[2];
-    int rc = recv(socketfd, (char*)resolution, sizeof(int32_t) * 2, 0);
+    NetGUI::InitData initData;
+    int rc = recv(socketfd, (char*)&initData, sizeof(initData), 0);
     if(rc == -1) {
         std::cout << "Couldn't get resolution from server" << std::endl;
         return -1;
     }
 
-    std::cout << "Got resolution: " << resolution[0] << "x" << resolution[1] << std::endl;
-    GUI::InitGUI(resolution[0], resolution[1]);
+    std::cout << "Got resolution: " << initData.resolution[0] << "x" << initData.resolution[1] << std::endl;
+    GUI::InitGUI(initData.resolution[0], initData.resolution[1], initData.settings);
 
     lua_State* luaState = luaL_newstate();
     luaL_openlibs(luaState);
@@ -164,8 +168,12 @@ int main(int argc, const char** argv)
                     int32_t pos[2];
                     pos[0] = *((int32_t*)(buffer + 1));
                     pos[1] = *((int32_t*)(buffer + 1 + sizeof(int32_t)));
-                    GUI::UpdateGUI(luaState, pos[0], pos[1]);
-                    Send(socketfd, "y", 1, run);
+                    GUI::UpdateStatus status = GUI::UpdateGUI(luaState, pos[0], pos[1]);
+                    // The client can't wait on the reload handle of this
+                    // process, so it has to come back to let changes be noticed
+                    if(status.nextUpdate == -1 && GUI::GetReloadHandle() != -1)
+                        status.nextUpdate = RELOAD_POLL_INTERVAL;
+                    Send(socketfd, (char*)&status, sizeof(status), run);
                     break;}
                 case NetGUI::FUNCTIONS::RegisterSharedLibrary:{
                     bool breakOnNext = false;
@@ -217,6 +225,10 @@ int main(int argc, const char** argv)
                     int32_t drawListCount = GUI::GetDrawListCount();
                     Send(socketfd, (char*)&drawListCount, sizeof(int32_t), run);
                     break;}
+                case NetGUI::FUNCTIONS::GetFrameGeneration: {
+                    uint64_t generation = GUI::GetFrameGeneration();
+                    Send(socketfd, (char*)&generation, sizeof(generation), run);
+                    break;}
                 case NetGUI::FUNCTIONS::GetDrawLists: {
                     const GUI::DrawList* drawLists = GUI::GetDrawLists();
                     int32_t drawListCount = GUI::GetDrawListCount();
@@ -226,12 +238,15 @@ int main(int argc, const char** argv)
                     if(!Recv(socketfd, buffer, 2, nullptr, run))
                         break;
                     for(int32_t i = 0; i < GUI::GetDrawListCount(); ++i) {
-                        NetGUI::Header header = { drawLists[i].vertexCount, drawLists[i].indexCount, drawLists[i].textureIndex, drawLists[i].clipRect };
+                        NetGUI::Header header = { drawLists[i].vertexCount, drawLists[i].indexCount, drawLists[i].textureIndex, drawLists[i].clipRect, drawLists[i].baseVertex, drawLists[i].instanceCount, drawLists[i].baseInstance, drawLists[i].generation };
 
                         if(!Send(socketfd, (char*)&header, sizeof(NetGUI::Header), run))
                             break;
                         if(!Recv(socketfd, buffer, 2, nullptr, run))
                             break;
+                        // The client already has this generation
+                        if(buffer[0] == 'n')
+                            continue;
 
                         if(header.vertexCount > 0) {
                             if(!Send(socketfd, (char*)drawLists[i].vertices, sizeof(GUI::Vertex) * header.vertexCount, run))
@@ -240,12 +255,20 @@ int main(int argc, const char** argv)
                                 break;
                         }
 
-                        if(header.indexCount > 0) {
+                        // The client creates quad indicies by itself
+                        if(header.indexCount > 0 && initData.settings.indexMode != GUI::IndexMode::SharedQuads) {
                             if(!Send(socketfd, (char*)drawLists[i].indicies, sizeof(uint32_t) * header.indexCount, run))
                                 break;
                             if(!Recv(socketfd, buffer, 2, nullptr, run))
                                 break;
                         }
+
+                        if(header.instanceCount > 0) {
+                            if(!Send(socketfd, (char*)drawLists[i].instances, sizeof(GUI::QuadInstance) * header.instanceCount, run))
+                                break;
+                            if(!Recv(socketfd, buffer, 2, nullptr, run))
+                                break;
+                        }
                     }
                 break;}
                 default:
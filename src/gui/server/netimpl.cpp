@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <iostream>
 #include <cassert>
+#include <algorithm>
 #include "shared.h"
 
 #define WAIT_AND_RETURN int status; waitpid(pid, &status, 0); pid = -1; return false;
@@ -193,7 +194,23 @@ void Close()
 
 size_t resolutionX;
 size_t resolutionY;
-bool NetGUI::InitGUI(size_t resolutionX, size_t resolutionY)
+GUI::Settings settings;
+
+// Draw lists are kept between calls to GetDrawLists, and only the ones
+// whose generation changed are sent again
+struct CachedDrawList
+{
+    uint64_t generation;
+    std::vector<GUI::Vertex> vertices;
+    std::vector<uint32_t> indicies;
+    std::vector<GUI::QuadInstance> instances;
+};
+std::vector<CachedDrawList> cachedDrawLists;
+// Frame generation of the cached draw lists, only valid if cacheValid is set
+static uint64_t cachedFrameGeneration = 0;
+static bool cacheValid = false;
+
+bool NetGUI::InitGUI(size_t resolutionX, size_t resolutionY, const GUI::Settings& settings/*= GUI::Settings()*/)
 {
     errno = 0;
     if(!ConnectToServer()) {
@@ -202,9 +219,12 @@ bool NetGUI::InitGUI(size_t resolutionX, size_t resolutionY)
 
     ::resolutionX = resolutionX;
     ::resolutionY = resolutionY;
+    ::settings = settings;
+    cacheValid = false;
+    cachedDrawLists.clear();
 
-    int32_t resolution[2] = { (int32_t)resolutionX, (int32_t)resolutionY };
-    if(!Send((char*)resolution, sizeof(resolution))) {
+    InitData initData = { { (int32_t)resolutionX, (int32_t)resolutionY }, settings };
+    if(!Send((char*)&initData, sizeof(initData))) {
         if(!ReconnectAndReinit())
             return false;
     }
@@ -307,10 +327,53 @@ void NetGUI::ResolutionChanged(lua_State* state, int32_t width, int32_t height)
     ReadPipe();
 }
 
-void NetGUI::UpdateGUI(lua_State* state, int32_t x, int32_t y)
+// Queued input isn't sent to the server as is, the events are forwarded as
+// regular calls when UpdateGUI is called instead
+static std::vector<GUI::InputEvent> inputEvents;
+static uint64_t lastInputTimestamp = 0;
+
+bool NetGUI::PushInput(const GUI::InputEvent& event)
 {
+    inputEvents.push_back(event);
+    return true;
+}
+
+uint64_t NetGUI::GetLastInputTimestamp()
+{
+    return lastInputTimestamp;
+}
+
+GUI::UpdateStatus NetGUI::UpdateGUI(lua_State* state, int32_t x, int32_t y)
+{
+    // Keep drawing at a steady rate while disconnected, the server may come back
+    GUI::UpdateStatus status = { true, 33 };
+
+    if(!inputEvents.empty()) {
+        // Moved out first, the calls below may reconnect
+        std::vector<GUI::InputEvent> events;
+        events.swap(inputEvents);
+        for(const GUI::InputEvent& event : events) {
+            switch(event.type) {
+                case GUI::InputEventType::MouseMove:
+                    break;
+                case GUI::InputEventType::MouseDown:
+                    MouseDown(state, event.x, event.y);
+                    break;
+                case GUI::InputEventType::MouseUp:
+                    MouseUp(state, event.x, event.y);
+                    break;
+                case GUI::InputEventType::Scroll:
+                    Scroll(state, event.x, event.y, event.scrollX, event.scrollY);
+                    break;
+            }
+        }
+        x = events.back().x;
+        y = events.back().y;
+        lastInputTimestamp = events.back().timestamp;
+    }
+
     if(!connected)
-        return;
+        return status;
 
     const static auto size = 1 + sizeof(int32_t) * 2;
     char buffer[size];
@@ -320,14 +383,15 @@ void NetGUI::UpdateGUI(lua_State* state, int32_t x, int32_t y)
     
     if(!Send(buffer, size)) {
         ReconnectAndReinit();
-        return;
+        return status;
     }
-    if(!Recv(buffer, 2)) {
+    if(!Recv((char*)&status, sizeof(status))) {
         ReconnectAndReinit();
-        return;
+        return status;
     }
 
     ReadPipe();
+    return status;
 }
 
 std::vector<std::pair<std::string, std::string>> libraries;
@@ -489,9 +553,8 @@ int32_t NetGUI::GetFontTextureHeight()
     return fontTextureHeight;
 }
 
-std::vector<GUI::Vertex> vertices;
-std::vector<uint32_t> indicies;
 std::vector<GUI::DrawList> drawLists;
+std::vector<uint32_t> quadIndicies;
 int32_t NetGUI::GetDrawListCount()
 {
     if(!connected)
@@ -512,11 +575,63 @@ int32_t NetGUI::GetDrawListCount()
     return drawListCount;
 }
 
+// Receives count elements into data, acknowledging them once done
+template<typename T>
+static bool RecvArray(T* data, int32_t count)
+{
+    size_t remainingData = sizeof(T) * count;
+    size_t writtenData = 0;
+    while(remainingData > 0) {
+        ssize_t newData;
+        if(!Recv(((char*)data) + writtenData, remainingData, &newData))
+            return false;
+        remainingData -= newData;
+        writtenData += newData;
+    }
+
+    if(!Send("y", 2))
+        return false;
+
+    ReadPipe();
+    return true;
+}
+
+int NetGUI::GetReloadHandle()
+{
+    return -1;
+}
+
+uint64_t NetGUI::GetFrameGeneration()
+{
+    if(!connected)
+        return 0;
+
+    char cmd = (char)NetGUI::FUNCTIONS::GetFrameGeneration;
+    if(!Send(&cmd, 1)) {
+        ReconnectAndReinit();
+        return 0;
+    }
+    uint64_t generation = 0;
+    if(!Recv((char*)&generation, sizeof(generation))) {
+        ReconnectAndReinit();
+        return 0;
+    }
+    ReadPipe();
+    return generation;
+}
+
 const GUI::DrawList* NetGUI::GetDrawLists()
 {
     if(!connected)
         return nullptr;
 
+    // Nothing has to be transfered if the frame hasn't changed
+    uint64_t frameGeneration = NetGUI::GetFrameGeneration();
+    if(!connected)
+        return nullptr;
+    if(cacheValid && frameGeneration == cachedFrameGeneration && drawLists.size() == cachedDrawLists.size())
+        return drawLists.data();
+
     char cmd = (char)NetGUI::FUNCTIONS::GetDrawLists;
     if(!Send(&cmd, 1)) {
         ReconnectAndReinit();
@@ -531,90 +646,112 @@ const GUI::DrawList* NetGUI::GetDrawLists()
         ReconnectAndReinit();
         return nullptr;
     }
-    vertices.resize(0);
-    indicies.resize(0);
+    drawLists.resize(drawListCount);
+    cachedDrawLists.resize(drawListCount);
+    cacheValid = false;
+
+    int32_t maxQuadCount = 0;
     for(int i = 0; i < drawListCount; ++i) {
-        size_t verticesOffset = vertices.size();
-        size_t indiciesOffset = indicies.size();
+        CachedDrawList& cached = cachedDrawLists[i];
 
         Header header;
         if(!Recv((char*)&header, sizeof(Header))) {
             ReconnectAndReinit();
             return nullptr;
         }
-        if(!Send("y", 2)) {
+
+        // Generations are unique, so a draw list with the same generation
+        // as the cached one has the same contents
+        bool needData = header.generation != cached.generation;
+        if(!Send(needData ? "y" : "n", 2)) {
             ReconnectAndReinit();
             return nullptr;
         }
 
-        if(header.vertexCount > 0) {
-            vertices.resize(vertices.size() + header.vertexCount);
-            size_t remainingData = sizeof(GUI::Vertex) * header.vertexCount;
-            size_t writtenData = 0;
-            while(remainingData > 0) {
-                ssize_t newData;
-                if(!Recv(((char*)&vertices[verticesOffset]) + writtenData, remainingData, &newData)) {
-                    ReconnectAndReinit();
-                    return nullptr;
-                }
-                remainingData -= newData;
-                writtenData += newData;
-            }
-
-            if(!Send("y", 2)) {
+        if(needData) {
+            cached.generation = header.generation;
+            cached.vertices.resize(header.vertexCount);
+            // Quad indicies are never sent, see GetQuadIndicies
+            cached.indicies.resize(settings.indexMode != GUI::IndexMode::SharedQuads ? header.indexCount : 0);
+            cached.instances.resize(header.instanceCount);
+
+            if((!cached.vertices.empty() && !RecvArray(cached.vertices.data(), cached.vertices.size()))
+                || (!cached.indicies.empty() && !RecvArray(cached.indicies.data(), cached.indicies.size()))
+                || (!cached.instances.empty() && !RecvArray(cached.instances.data(), cached.instances.size()))) {
+                cached.generation = 0;
                 ReconnectAndReinit();
                 return nullptr;
             }
-
-            ReadPipe();
         }
 
-        if(header.indexCount > 0) {
-            indicies.resize(indicies.size() + header.indexCount);
-            size_t remainingData = sizeof(uint32_t) * header.indexCount;
-            size_t writtenData = 0;
-            while(remainingData > 0) {
-                ssize_t newData;
-                if(!Recv(((char*)&indicies[indiciesOffset]) + writtenData, remainingData, &newData)) {
-                    ReconnectAndReinit();
-                    return nullptr;
-                }
-                remainingData -= newData;
-                writtenData += newData;
-            }
-
-            if(!Send("y", 2)) {
-                ReconnectAndReinit();
-                return nullptr;
+        GUI::DrawList& drawList = drawLists[i];
+        drawList.vertices = cached.vertices.data();
+        drawList.vertexCount = header.vertexCount;
+        drawList.indicies = cached.indicies.data();
+        drawList.indexCount = header.indexCount;
+        drawList.instances = cached.instances.data();
+        drawList.instanceCount = header.instanceCount;
+        drawList.textureIndex = header.textureIndex;
+        drawList.clipRect = header.clipRect;
+        drawList.baseVertex = header.baseVertex;
+        drawList.baseInstance = header.baseInstance;
+        drawList.generation = header.generation;
+        if(settings.indexMode == GUI::IndexMode::SharedQuads)
+            maxQuadCount = std::max(maxQuadCount, header.indexCount / 6);
+    }
+
+    if(settings.indexMode == GUI::IndexMode::SharedQuads) {
+        // The quad indicies are always the same, so they are created here
+        // instead of being sent by the server
+        int32_t oldQuadCount = (int32_t)quadIndicies.size() / 6;
+        if(maxQuadCount > oldQuadCount) {
+            quadIndicies.resize(maxQuadCount * 6);
+            for(int32_t i = oldQuadCount; i < maxQuadCount; ++i) {
+                uint32_t* quad = &quadIndicies[i * 6];
+                quad[0] = i * 4;
+                quad[1] = i * 4 + 1;
+                quad[2] = i * 4 + 3;
+                quad[3] = i * 4 + 1;
+                quad[4] = i * 4 + 2;
+                quad[5] = i * 4 + 3;
             }
-
-            ReadPipe();
         }
 
-        drawLists[i].vertexCount = header.vertexCount;
-        drawLists[i].indexCount = header.indexCount;
-        drawLists[i].vertices = vertices.data() + verticesOffset;
-        drawLists[i].indicies = indicies.data() + indiciesOffset;
-        drawLists[i].textureIndex = header.textureIndex;
-        drawLists[i].clipRect = header.clipRect;
+        for(int i = 0; i < drawListCount; ++i)
+            drawLists[i].indicies = quadIndicies.data();
     }
 
+    cachedFrameGeneration = frameGeneration;
+    cacheValid = true;
     return drawLists.data();
 }
 
+const uint32_t* NetGUI::GetQuadIndicies()
+{
+    return quadIndicies.data();
+}
+
+int32_t NetGUI::GetQuadIndexCount()
+{
+    return (int32_t)quadIndicies.size();
+}
+
 static bool reconnecting = false;
 bool ReconnectAndReinit()
 {
     if(tryReconnect) {
         tryReconnect = false;
         pid = -1;
+        // The new server starts over with its generations
+        cacheValid = false;
+        cachedDrawLists.clear();
         Close();
         if(!ConnectToServer()) {
             return false;
         }
 
-        int32_t resolution[2] = { (int32_t)resolutionX, (int32_t)resolutionY };
-        int bytes = send(clientSocket, (char*)resolution, sizeof(resolution), 0);
+        NetGUI::InitData initData = { { (int32_t)resolutionX, (int32_t)resolutionY }, settings };
+        int bytes = send(clientSocket, (char*)&initData, sizeof(initData), 0);
         if(bytes == -1) {
             std::cerr << "send failed" << std::endl;
             WAIT_AND_RETURN;
@@ -19,19 +19,24 @@
 
 namespace NetGUI 
 {
-    bool InitGUI(size_t resolutionX, size_t resolutionY);
+    bool InitGUI(size_t resolutionX, size_t resolutionY, const GUI::Settings& settings = GUI::Settings());
     void BuildGUI(lua_State* state, const char* path);
     void ReloadGUI(lua_State* state);
+    // Always -1, the server watches for changes itself
+    int GetReloadHandle();
     void DestroyGUI(lua_State* state);
     void ResolutionChanged(lua_State* state, int32_t width, int32_t height);
 
-    void UpdateGUI(lua_State* state, int32_t x, int32_t y);
+    GUI::UpdateStatus UpdateGUI(lua_State* state, int32_t x, int32_t y);
     
     void RegisterSharedLibrary(const char* name, const char* path);
 
     void MouseDown(lua_State* state, int32_t x, int32_t y);
     void MouseUp(lua_State* state, int32_t x, int32_t y);
     void Scroll(lua_State* state, int32_t mouseX, int32_t mouseY, int32_t scrollX, int32_t scrollY);
+    // Unlike GUI::PushInput this must be called from the thread calling UpdateGUI
+    bool PushInput(const GUI::InputEvent& event);
+    uint64_t GetLastInputTimestamp();
 
     const uint8_t* GetFontTextureData();
     int32_t GetFontTextureWidth();
@@ -39,6 +44,9 @@ namespace NetGUI
 
     int32_t GetDrawListCount();
     const GUI::DrawList* GetDrawLists();
+    uint64_t GetFrameGeneration();
+    const uint32_t* GetQuadIndicies();
+    int32_t GetQuadIndexCount();
 }
 
 
@@ -19,13 +19,24 @@ namespace NetGUI
             , GetFontTextureHeight
             , GetDrawListCount
             , GetDrawLists
+            , GetFrameGeneration
         };
     }
 
+    // Sent to the server once it has connected
+    struct InitData {
+        int32_t resolution[2];
+        GUI::Settings settings;
+    };
+
     struct Header {
         int32_t vertexCount;
         int32_t indexCount;
         int32_t textureIndex;
         GUI::Rect clipRect;
+        int32_t baseVertex;
+        int32_t instanceCount;
+        int32_t baseInstance;
+        uint64_t generation;
     };
 }
\ No newline at end of file
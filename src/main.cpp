@@ -1,15 +1,20 @@
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <set>
 #include <glm/gtc/matrix_transform.hpp>
 #include <string>
 #include <iostream>
+#include <cerrno>
+#include <cstring>
 
 #include "timer.h"
 
 #include <gl3w.h>
 #include <lua5.1/lua.hpp>
 #include <SDL.h>
+#include <poll.h>
 
 #include <gui/glimpl.h>
 
@@ -26,6 +31,50 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
 }
 int luaMemoryUsage = 0;
 
+// SDL can't wait on file descriptors, so this thread waits on the GUI's
+// reload handle and wakes the main loop with an event. It waits for the main
+// loop to call ReloadGUI before watching again
+static Uint32 reloadEvent;
+static std::mutex reloadMutex;
+static std::condition_variable reloadHandled;
+static bool reloadPending = false;
+
+void WatchReloadHandle(int reloadHandle)
+{
+    while(true) {
+        struct pollfd fds;
+        fds.fd = reloadHandle;
+        fds.events = POLLIN;
+        int result = poll(&fds, 1, -1);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result < 0 || (fds.revents & (POLLERR | POLLNVAL)) != 0) {
+            std::cerr << "Stopped watching for GUI reloads: " << (result < 0 ? strerror(errno) : "bad reload handle") << std::endl;
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(reloadMutex);
+        reloadPending = true;
+        SDL_Event event;
+        SDL_zero(event);
+        event.type = reloadEvent;
+        SDL_PushEvent(&event);
+        reloadHandled.wait(lock, []{ return !reloadPending; });
+    }
+}
+
+// The input queue only fills up when lots of events arrive between two
+// updates. Handling the queued events makes room, so none are dropped
+void PushInput(lua_State* state, const GUI::InputEvent& event, bool& redraw)
+{
+    if(GLGUI::PushInput(event))
+        return;
+
+    if(GLGUI::UpdateGUI(state, event.x, event.y).redraw)
+        redraw = true;
+    GLGUI::PushInput(event);
+}
+
 void RegisterExtensions()
 {
     GLGUI::RegisterSharedLibrary("linear", "./bin/liblinear.so");
@@ -73,7 +122,10 @@ int main(int argc, char* argv[])
         return 1;
     }
 
-    GLGUI::InitGUI(resolutionX, resolutionY);
+    // DrawListFormat::QuadInstances can be used with a GL 3.3 context
+    GUI::Settings guiSettings;
+    guiSettings.vertexArena = true;
+    GLGUI::InitGUI(resolutionX, resolutionY, guiSettings);
     
     #ifndef BUILD_SERVER
     lua_State* luaState = lua_newstate(&l_alloc, &luaMemoryUsage);
@@ -86,39 +138,88 @@ int main(int argc, char* argv[])
     RegisterExtensions();
     GLGUI::BuildGUI(luaState, "content/lua/example.lua");
 
+    int reloadHandle = GLGUI::GetReloadHandle();
+    if(reloadHandle != -1) {
+        reloadEvent = SDL_RegisterEvents(1);
+        std::thread(WatchReloadHandle, reloadHandle).detach();
+    }
+
     Timer timer;
     timer.UpdateDelta();
 
     bool run = true;
+    bool redraw = true;
     while(run)
     {
         timer.UpdateDelta();
         GLGUI::ReloadGUI(luaState);
+        {
+            std::lock_guard<std::mutex> lock(reloadMutex);
+            if(reloadPending) {
+                reloadPending = false;
+                reloadHandled.notify_one();
+            }
+        }
 
         int mouseX;
         int mouseY;
         SDL_GetMouseState(&mouseX, &mouseY);
         Timer guiTimer;
         guiTimer.Start();
-        GLGUI::UpdateGUI(luaState, mouseX, mouseY);
+        GUI::UpdateStatus status = GLGUI::UpdateGUI(luaState, mouseX, mouseY);
         guiTimer.Stop();
         //std::cout << "Update: " << guiTimer.GetTimeMillisecondsFraction() << std::endl;
         guiTimer.Reset();
 
+        if(redraw || status.redraw) {
+            glClearColor(0.2f, 0.2f, 0.5f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+
+            guiTimer.Start();
+            GLGUI::DrawGUI();
+            guiTimer.Stop();
+            //std::cout << "Draw: " << guiTimer.GetTimeMillisecondsFraction() << std::endl;
+            guiTimer.Reset();
+
+            SDL_GL_SwapWindow(window);
+            redraw = false;
+        }
+
+        // Cap continuous updates at 30 fps, otherwise sleep below
+        if(status.nextUpdate == 0) {
+            timer.UpdateDelta();
+            auto time = timer.GetDelta();
+            if(time.count() < 33333333) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(33333333 - time.count()));
+            }
+        }
+
+        // Sleep until there is input, or until the GUI needs another update
         SDL_Event event;
-        while(SDL_PollEvent(&event) != 0) {
+        int hasEvent;
+        if(status.nextUpdate == -1)
+            hasEvent = SDL_WaitEvent(&event);
+        else
+            hasEvent = SDL_WaitEventTimeout(&event, status.nextUpdate);
+
+        while(hasEvent != 0) {
             switch(event.type) {
                 case SDL_QUIT:
                     run = false;
                     break;
+                case SDL_MOUSEMOTION:
+                    mouseX = event.motion.x;
+                    mouseY = event.motion.y;
+                    PushInput(luaState, { GUI::InputEventType::MouseMove, event.motion.timestamp, mouseX, mouseY, 0, 0 }, redraw);
+                    break;
                 case SDL_MOUSEBUTTONDOWN:
-                    GLGUI::MouseDown(luaState, mouseX, mouseY);
+                    PushInput(luaState, { GUI::InputEventType::MouseDown, event.button.timestamp, event.button.x, event.button.y, 0, 0 }, redraw);
                     break;
                 case SDL_MOUSEBUTTONUP:
-                    GLGUI::MouseUp(luaState, mouseX, mouseY);
+                    PushInput(luaState, { GUI::InputEventType::MouseUp, event.button.timestamp, event.button.x, event.button.y, 0, 0 }, redraw);
                     break;
                 case SDL_MOUSEWHEEL:
-                    GLGUI::Scroll(luaState, mouseX, mouseY, (int32_t)event.wheel.x * 20, (int32_t)event.wheel.y * 20);
+                    PushInput(luaState, { GUI::InputEventType::Scroll, event.wheel.timestamp, mouseX, mouseY, (int32_t)event.wheel.x * 20, (int32_t)event.wheel.y * 20 }, redraw);
                     break;
                 case SDL_KEYDOWN:
                     switch(event.key.keysym.sym) {
@@ -127,7 +228,7 @@ int main(int argc, char* argv[])
                             if((mod & ~KMOD_NUM) == KMOD_NONE)
                                 GLGUI::BuildGUI(luaState, "content/lua/example.lua");
                             else if((mod & KMOD_SHIFT) == KMOD_SHIFT) {
-                                GLGUI::InitGUI(resolutionX, resolutionY);
+                                GLGUI::InitGUI(resolutionX, resolutionY, guiSettings);
                                 RegisterExtensions();
                                 GLGUI::BuildGUI(luaState, "content/lua/example.lua");
                             }
@@ -142,28 +243,16 @@ int main(int argc, char* argv[])
                             resolutionY = event.window.data2;
                             glViewport(0, 0, resolutionX, resolutionY);
                             GLGUI::ResolutionChanged(luaState, resolutionX, resolutionY);
+                            redraw = true;
+                            break;
+                        case SDL_WINDOWEVENT_EXPOSED:
+                            redraw = true;
                             break;
                     }
                     break;
             }
-        }
 
-        glClearColor(0.2f, 0.2f, 0.5f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
-
-        guiTimer.Start();
-        GLGUI::DrawGUI();
-        guiTimer.Stop();
-        //std::cout << "Draw: " << guiTimer.GetTimeMillisecondsFraction() << std::endl;
-        guiTimer.Reset();
-
-
-        SDL_GL_SwapWindow(window);
-
-        timer.UpdateDelta();
-        auto time = timer.GetDelta();
-        if(time.count() < 33333333) {
-            std::this_thread::sleep_for(std::chrono::nanoseconds(33333333 - time.count()));
+            hasEvent = SDL_PollEvent(&event);
         }
     }
 